@@ -10,3 +10,4 @@
 #define CONFIG_SPIFFS_MAX_PARTITIONS 3
 #define CONFIG_SPIFFS_OBJ_NAME_LEN 32
 #define CONFIG_SPIFFS_PAGE_SIZE 256
+#define CONFIG_SPIFFS_NAME_INDEX 1
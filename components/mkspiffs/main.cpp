@@ -8,571 +8,1130 @@
 #define TCLAP_SETBASE_ZERO 1
 
 #include <iostream>
-#include "spiffs.h"
-#include "spiffs_nucleus.h"
-#include <time.h>
+#include "spiffs_image.h"
 #include <vector>
+#include <map>
 #include <dirent.h>
-#include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstring>
 #include <string>
 #include <memory>
 #include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#include <direct.h>
+#endif
 #include "tclap/CmdLine.h"
 #include "tclap/UnlabeledValueArg.h"
 
-#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
-/**
- * @brief SPIFFS metadata structure
- */
-typedef struct {
-#ifdef CONFIG_SPIFFS_USE_MTIME
-    s32_t mtime;   /*!< file modification time */
-#endif
-#ifdef CONFIG_SPIFFS_USE_DIR
-    u8_t type;      /*!< file type */
-#endif
-} __attribute__((packed, aligned(1))) spiffs_meta_t;
-#endif
-
-
-static std::vector<uint8_t> s_flashmem;
+using mkspiffs::Image;
+using mkspiffs::SourceFile;
+using mkspiffs::FileInfo;
+using mkspiffs::SourceCache;
+using mkspiffs::hashUpdate;
+using mkspiffs::printThroughput;
+using mkspiffs::HASH_INIT;
 
 static std::string s_dirName;
 static std::string s_imageName;
+static std::string s_baseImageName;
+static std::string s_deltaName;
+static std::string s_manifestName;
+static std::string s_rangesName;
+static std::string s_orderName;
+static std::string s_cacheDir;
+static std::string s_wearName;
 static int s_imageSize;
 static int s_pageSize;
 static int s_blockSize;
+static int s_jobs;
+static int s_headroom;
 
-enum Action { ACTION_NONE, ACTION_PACK, ACTION_UNPACK, ACTION_LIST, ACTION_VISUALIZE };
+enum Action { ACTION_NONE, ACTION_PACK, ACTION_UNPACK, ACTION_LIST, ACTION_VISUALIZE, ACTION_UPDATE,
+              ACTION_DIFF, ACTION_PATCH, ACTION_BATCH, ACTION_ANALYZE, ACTION_TUNE, ACTION_VERIFY,
+              ACTION_SIMULATE };
 static Action s_action = ACTION_NONE;
 
-static spiffs s_fs;
-
-static std::vector<uint8_t> s_spiffsWorkBuf;
-static std::vector<uint8_t> s_spiffsFds;
-static std::vector<uint8_t> s_spiffsCache;
-
 static int s_debugLevel = 0;
 static bool s_addAllFiles;
+static bool s_directLayout;
+static bool s_compareHash;
+static bool s_minSize;
+static bool s_trim;
+static bool s_nameIndex;
+static bool s_cacheLink;
+static bool s_plan;
+static int s_spareBlocks;
+static mkspiffs::FlashTiming s_flashTiming;
 
-// Unless -a flag is given, these files/directories will not be included into the image
-static const char* ignored_file_names[] = {
-    ".DS_Store",
-    ".git",
-    ".gitignore",
-    ".gitmodules"
-};
+/**
+ * @brief Check if directory exists.
+ * @param path Directory path.
+ * @return True if exists otherwise false.
+ *
+ * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ */
+bool dirExists(const char* path) {
+    DIR *d = opendir(path);
 
-#if SPIFFS_HAL_CALLBACK_EXTRA
-static s32_t api_spiffs_read(struct spiffs_t *fs, u32_t addr, u32_t size, u8_t *dst){
-    memcpy(dst, &s_flashmem[0] + addr, size);
-    return SPIFFS_OK;
-}
+    if (d) {
+        closedir(d);
+        return true;
+    }
 
-static s32_t api_spiffs_write(struct spiffs_t *fs, u32_t addr, u32_t size, u8_t *src){
-    memcpy(&s_flashmem[0] + addr, src, size);
-    return SPIFFS_OK;
+    return false;
 }
 
-static s32_t api_spiffs_erase(struct spiffs_t *fs, u32_t addr, u32_t size){
-    memset(&s_flashmem[0] + addr, 0xff, size);
-    return SPIFFS_OK;
-}
-#else
-static s32_t api_spiffs_read(u32_t addr, u32_t size, u8_t *dst){
-    memcpy(dst, &s_flashmem[0] + addr, size);
-    return SPIFFS_OK;
+/**
+ * @brief Set up an image with the command line geometry and options.
+ */
+static void imageSetup(Image& img, std::ostream* log, std::ostream* err) {
+    img.setLog(log, err, s_debugLevel);
+    img.setDirectLayout(s_directLayout);
+    img.setCompareHash(s_compareHash);
+    img.setNameIndex(s_nameIndex);
 }
 
-static s32_t api_spiffs_write(u32_t addr, u32_t size, u8_t *src){
-    memcpy(&s_flashmem[0] + addr, src, size);
-    return SPIFFS_OK;
+// Image delta
+//
+// A delta lists the erase blocks that differ between two images of the
+// same geometry. For each block it carries a bitmap of changed pages, a
+// bitmap of those changed pages that are fully erased, and the contents of
+// the remaining changed pages. Unchanged pages are taken from the block
+// already on flash, so a device applies it block by block: read the old
+// block, overlay the pages, erase, write. All fields are little endian.
+//
+//   u32 magic, u32 version, u32 image size, u32 block size, u32 page size,
+//   u64 FNV-1a hash of the new image, u32 number of blocks
+//   per block: u32 block index, changed bitmap, erased bitmap, page data
+static const uint32_t s_deltaMagic = 0x44465053; // "SPFD"
+static const uint32_t s_deltaVersion = 1;
+
+static void putU32(std::vector<uint8_t>& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back((v >> (8 * i)) & 0xff);
+    }
 }
 
-static s32_t api_spiffs_erase(u32_t addr, u32_t size){
-    memset(&s_flashmem[0] + addr, 0xff, size);
-    return SPIFFS_OK;
+static void putU64(std::vector<uint8_t>& out, uint64_t v) {
+    putU32(out, (uint32_t)v);
+    putU32(out, (uint32_t)(v >> 32));
 }
-#endif
-
 
+static bool getU32(const std::vector<uint8_t>& in, size_t& pos, uint32_t* v) {
+    if (pos + 4 > in.size()) {
+        return false;
+    }
+    *v = in[pos] | (in[pos + 1] << 8) | (in[pos + 2] << 16) | ((uint32_t)in[pos + 3] << 24);
+    pos += 4;
+    return true;
+}
 
-//implementation
+static bool getU64(const std::vector<uint8_t>& in, size_t& pos, uint64_t* v) {
+    uint32_t lo, hi;
+    if (!getU32(in, pos, &lo) || !getU32(in, pos, &hi)) {
+        return false;
+    }
+    *v = ((uint64_t)hi << 32) | lo;
+    return true;
+}
 
-int spiffsTryMount(){
-    spiffs_config cfg = {0};
+static bool readFile(const std::string& path, std::vector<uint8_t>& data) {
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) {
+        std::cerr << "error: failed to open " << path << std::endl;
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    data.resize(ftell(f));
+    fseek(f, 0, SEEK_SET);
+    bool ok = data.empty() || fread(&data[0], 1, data.size(), f) == data.size();
+    fclose(f);
+    if (!ok) {
+        std::cerr << "error: failed to read " << path << std::endl;
+    }
+    return ok;
+}
 
-    cfg.phys_addr = 0x0000;
-    cfg.phys_size = (u32_t) s_flashmem.size();
+static bool writeFile(const std::string& path, const uint8_t* data, size_t size) {
+    // a new file, leaving any hard link to the old one (a cache entry) alone
+    remove(path.c_str());
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "error: failed to open " << path << " for writing" << std::endl;
+        return false;
+    }
+    bool ok = fwrite(data, 1, size, f) == size;
+    fclose(f);
+    if (!ok) {
+        std::cerr << "error: failed to write " << path << std::endl;
+    }
+    return ok;
+}
 
-    cfg.phys_erase_block = s_blockSize;
-    cfg.log_block_size = s_blockSize;
-    cfg.log_page_size = s_pageSize;
+/**
+ * @brief Read a base image of s_imageSize bytes; a short file reads as erased flash.
+ */
+static bool readBaseImage(std::vector<uint8_t>& base) {
+    if (s_baseImageName.empty()) {
+        std::cerr << "error: --base image is required" << std::endl;
+        return false;
+    }
+    if (!readFile(s_baseImageName, base)) {
+        return false;
+    }
+    base.resize(s_imageSize, 0xff);
+    return true;
+}
 
-    cfg.hal_read_f = api_spiffs_read;
-    cfg.hal_write_f = api_spiffs_write;
-    cfg.hal_erase_f = api_spiffs_erase;
+static bool pageErased(const uint8_t* page, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (page[i] != 0xff) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    const int maxOpenFiles = 4;
-    s_spiffsWorkBuf.resize(s_pageSize * 2);
-    s_spiffsFds.resize(sizeof(spiffs_fd) * maxOpenFiles);
-    s_spiffsCache.resize(sizeof(spiffs_cache) + maxOpenFiles * (sizeof(spiffs_cache_page) + cfg.log_page_size));
+// Actions
 
-    return SPIFFS_mount(&s_fs, &cfg,
-        &s_spiffsWorkBuf[0],
-        &s_spiffsFds[0], s_spiffsFds.size(),
-        &s_spiffsCache[0], s_spiffsCache.size(),
-        NULL);
+/**
+ * @brief Collect the source tree named on the command line: a directory,
+ *        or for "-" a tar stream read from stdin.
+ */
+static bool collectSource(std::vector<SourceFile>& files) {
+    if (s_dirName != "-") {
+        if (!mkspiffs::collectFiles(s_dirName, files, s_addAllFiles, &std::cerr)) {
+            std::cerr << "error: can't read source directory" << std::endl;
+            return false;
+        }
+        return true;
+    }
+#if defined(_WIN32)
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    std::string error;
+    if (!mkspiffs::readTar(stdin, files, s_addAllFiles, &std::cerr, error)) {
+        std::cerr << "error: " << error << std::endl;
+        return false;
+    }
+    return true;
 }
 
-bool spiffsMount(){
-  if(SPIFFS_mounted(&s_fs))
-    return true;
-  int res = spiffsTryMount();
-  return (res == SPIFFS_OK);
+/**
+ * @brief Create the image file and write the collected files into it.
+ *
+ * For image file "-" the image is built in memory and left there for the
+ * caller to write to stdout.
+ * @return 0 success, 1 error
+ */
+static int packImage(Image& img, const std::string& imageName, const std::vector<SourceFile>& files, std::ostream& log) {
+    bool ok;
+    if (imageName == "-") {
+        ok = img.create() && img.pack(files);
+    } else {
+        ok = img.open(imageName, mkspiffs::IMAGE_CREATE) && img.pack(files);
+        if (!img.close()) {
+            ok = false;
+        }
+    }
+    if (s_debugLevel > 0) {
+        printThroughput(log, "total written", img.importedBytes(), img.importSeconds());
+    }
+    return ok ? 0 : 1;
 }
 
-bool spiffsFormat(){
-  spiffsMount();
-  SPIFFS_unmount(&s_fs);
-  int formated = SPIFFS_format(&s_fs);
-  if(formated != SPIFFS_OK)
+/**
+ * @brief Find the smallest image, in whole blocks and at most s_imageSize
+ *        bytes, that holds the files with s_headroom blocks left free for
+ *        garbage collection.
+ *
+ * The files are packed at full size first to see how many blocks they
+ * take; images from that many blocks plus the headroom upwards are then
+ * packed in memory until one keeps the headroom free. The block count is
+ * part of the block magic, so the partition has to be given this size too.
+ */
+static bool minimalImageSize(const std::vector<SourceFile>& files, int* size) {
+    std::string error;
+    auto packBlocks = [&](size_t blocks, mkspiffs::Analysis& analysis) {
+        std::ostringstream err;
+        Image img(blocks * s_blockSize, s_pageSize, s_blockSize);
+        img.setLog(NULL, &err);
+        img.setDirectLayout(s_directLayout);
+        img.setNameIndex(s_nameIndex);
+        bool ok = img.create() && img.pack(files) && img.analyze(analysis);
+        error = img.error();
+        return ok;
+    };
+
+    size_t maxBlocks = s_imageSize / s_blockSize;
+    mkspiffs::Analysis analysis;
+    if (!packBlocks(maxBlocks, analysis)) {
+        std::cerr << "error: " << error << std::endl;
+        return false;
+    }
+    size_t used = analysis.blockCount - analysis.freeBlocks;
+    for (size_t blocks = std::min(maxBlocks, used + s_headroom); blocks <= maxBlocks; ++blocks) {
+        if (packBlocks(blocks, analysis) && analysis.freeBlocks >= (size_t)s_headroom) {
+            *size = (int)(blocks * s_blockSize);
+            return true;
+        }
+    }
+    std::cerr << "error: no image of up to " << s_imageSize << " bytes keeps "
+              << s_headroom << " blocks free" << std::endl;
     return false;
-  return (spiffsTryMount() == SPIFFS_OK);
 }
 
-void spiffsUnmount(){
-  if(SPIFFS_mounted(&s_fs))
-    SPIFFS_unmount(&s_fs);
-}
+/**
+ * @brief Find the ranges of an image that are not erased flash and write
+ *        them to the range manifest, if one was asked for.
+ *
+ * Flash is compared page by page, so a flashing tool working from an
+ * erased chip only has to program the listed ranges. Each line of the
+ * range manifest holds the hex offset and length of one range.
+ * @param end Set to the end of the last range.
+ * @return 0 success, 1 error
+ */
+static int sparseRanges(const uint8_t* image, size_t size, std::ostream& log, size_t* end) {
+    std::vector<std::pair<size_t, size_t> > ranges;
+    size_t programmed = 0;
+    for (size_t pos = 0; pos < size; pos += s_pageSize) {
+        size_t len = std::min((size_t)s_pageSize, size - pos);
+        if (pageErased(&image[pos], len)) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == pos) {
+            ranges.back().second += len;
+        } else {
+            ranges.push_back(std::make_pair(pos, len));
+        }
+        programmed += len;
+    }
+    log << programmed << " of " << size << " bytes not erased, in "
+        << ranges.size() << " ranges" << std::endl;
+
+    if (!s_rangesName.empty()) {
+        std::ofstream out(s_rangesName.c_str());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            out << "0x" << std::hex << std::setw(8) << std::setfill('0') << ranges[i].first
+                << " 0x" << std::setw(0) << ranges[i].second << std::endl;
+        }
+        if (!out) {
+            std::cerr << "error: failed to write " << s_rangesName << std::endl;
+            return 1;
+        }
+    }
 
-static void spiffs_update_meta(spiffs *fs, spiffs_file fd, u8_t type)
-{
-#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
-    spiffs_meta_t meta;
-#ifdef CONFIG_SPIFFS_USE_MTIME
-    meta.mtime = time(NULL);
-#endif //CONFIG_SPIFFS_USE_MTIME
+    *end = ranges.empty() ? 0 : ranges.back().first + ranges.back().second;
+    return 0;
+}
 
-#ifdef CONFIG_SPIFFS_USE_DIR
-    // Add file type (directory or regular file) to the last byte of metadata
-    meta.type = type;
-#endif
-    int ret = SPIFFS_fupdate_meta(fs, fd, (uint8_t *)&meta);
-    if (ret != SPIFFS_OK) {
-        std::cerr << "error: Failed to update metadata: " << ret << std::endl;
+/**
+ * @brief Write the range manifest of the image file and cut the erased
+ *        tail off the image file.
+ */
+static int writeSparse(const std::string& imageName, std::ostream& log) {
+    std::vector<uint8_t> image;
+    if (!readFile(imageName, image)) {
+        return 1;
     }
-#endif
+    size_t end;
+    if (sparseRanges(image.empty() ? NULL : &image[0], image.size(), log, &end) != 0) {
+        return 1;
+    }
+    if (s_trim && !writeFile(imageName, image.empty() ? NULL : &image[0], end)) {
+        return 1;
+    }
+    return 0;
 }
 
-/*
-static time_t spiffs_get_mtime(const spiffs_stat* s)
-{
-    time_t t = 0;
-#ifdef CONFIG_SPIFFS_USE_MTIME
-    spiffs_meta_t meta;
-    memcpy(&meta, s->meta, sizeof(meta));
-    t = meta.mtime;
+/**
+ * @brief Write an image held in memory to stdout, with the same range
+ *        manifest and trimming as an image file gets.
+ */
+static int writeStdout(const uint8_t* image, size_t size, std::ostream& log) {
+    size_t end = size;
+    if ((s_trim || !s_rangesName.empty()) && sparseRanges(image, size, log, &end) != 0) {
+        return 1;
+    }
+    size_t len = s_trim ? end : size;
+#if defined(_WIN32)
+    _setmode(_fileno(stdout), _O_BINARY);
 #endif
-    return t;
+    if (fwrite(image, 1, len, stdout) != len || fflush(stdout) != 0) {
+        std::cerr << "error: failed to write image to stdout" << std::endl;
+        return 1;
+    }
+    return 0;
 }
 
-
-static int get_spiffs_stat(const char * path, struct stat * st)
-{
-    spiffs_stat s;
-    off_t res = SPIFFS_stat(&s_fs, path, &s);
-    if (res < 0) {
-        SPIFFS_clearerr(&s_fs);
-        return -1;
+/**
+ * @brief Pick the packing order that leaves the most room in the image.
+ *
+ * Besides the collected order, files are tried largest first and smallest
+ * first, directories ahead of all files. Each order is packed in memory
+ * and the one leaving room for the largest new file wins; ties keep the
+ * earlier candidate. With --direct files take the same pages in any
+ * order, so the collected order stays.
+ *
+ * If no order fits, the pages the files need are compared with the pages
+ * the image offers, to tell how far off it is.
+ */
+static bool planOrder(std::vector<SourceFile>& files, std::ostream& log) {
+    auto bySize = [](const SourceFile& a, const SourceFile& b, bool largest) {
+        if (a.isDir != b.isDir) {
+            return a.isDir;
+        }
+        return largest ? a.size > b.size : a.size < b.size;
+    };
+    std::vector<std::pair<const char*, std::vector<SourceFile> > > orders;
+    orders.push_back(std::make_pair("collected", files));
+    orders.push_back(std::make_pair("largest first", files));
+    std::stable_sort(orders.back().second.begin(), orders.back().second.end(),
+                     [&](const SourceFile& a, const SourceFile& b) { return bySize(a, b, true); });
+    orders.push_back(std::make_pair("smallest first", files));
+    std::stable_sort(orders.back().second.begin(), orders.back().second.end(),
+                     [&](const SourceFile& a, const SourceFile& b) { return bySize(a, b, false); });
+
+    size_t best = orders.size();
+    size_t bestRoom = 0;
+    for (size_t i = 0; i < orders.size(); ++i) {
+        std::ostringstream err;
+        Image img(s_imageSize, s_pageSize, s_blockSize);
+        img.setLog(NULL, &err);
+        img.setDirectLayout(s_directLayout);
+        img.setNameIndex(s_nameIndex);
+        size_t room;
+        if (!img.create() || !img.pack(orders[i].second) || !img.largestNewFile(&room)) {
+            if (s_debugLevel > 0) {
+                log << "order " << orders[i].first << ": " << img.error() << std::endl;
+            }
+            continue;
+        }
+        if (s_debugLevel > 0) {
+            log << "order " << orders[i].first << ": largest new file " << room << " bytes" << std::endl;
+        }
+        if (best == orders.size() || room > bestRoom) {
+            best = i;
+            bestRoom = room;
+        }
+    }
+    if (best < orders.size()) {
+        log << "packing order: " << orders[best].first << std::endl;
+        files.swap(orders[best].second);
+        return true;
     }
 
-    st->st_size = s.size;
-#ifdef CONFIG_SPIFFS_USE_DIR
-    spiffs_meta_t *meta = (spiffs_meta_t *)&s.meta;
-    if (meta->type == SPIFFS_TYPE_DIR) st->st_mode = S_IFDIR;
-    else st->st_mode = S_IFREG;
-#else
-    st->st_mode = (s.type == SPIFFS_TYPE_DIR)?S_IFDIR:S_IFREG;
-#endif
-    st->st_mtime = spiffs_get_mtime(&s);
-    st->st_atime = 0;
-    st->st_ctime = 0;
-    return res;
+    // Pages the files take, laid out without deleted pages, against those
+    // the image has outside the two blocks kept free for garbage collection
+    size_t imageBlocks = s_imageSize / s_blockSize;
+    for (size_t blocks = imageBlocks * 2; blocks * s_blockSize / s_pageSize <= 0x10000; blocks *= 2) {
+        mkspiffs::Analysis analysis;
+        Image img(blocks * s_blockSize, s_pageSize, s_blockSize);
+        img.setLog(NULL, NULL);
+        img.setDirectLayout(true);
+        if (img.create() && img.pack(files) && img.analyze(analysis)) {
+            size_t usable = (imageBlocks - std::min((size_t)2, imageBlocks))
+                            * (analysis.pagesPerBlock - analysis.lookupPagesPerBlock);
+            std::cerr << "error: no packing order fits; the files take " << analysis.usedPages
+                      << " pages, the image has " << usable << std::endl;
+            return false;
+        }
+    }
+    std::cerr << "error: no packing order fits" << std::endl;
+    return false;
 }
-*/
 
-int addFile(char* name, const char* path) {
-    FILE* src = fopen(path, "rb");
-    if (!src) {
-        std::cerr << "error: failed to open " << path << " for reading" << std::endl;
+/**
+ * @brief Report the room left in a packed image.
+ */
+static int reportHeadroom(Image& img, std::ostream& log) {
+    mkspiffs::Analysis analysis;
+    size_t room;
+    if (!img.analyze(analysis) || !img.largestNewFile(&room)) {
         return 1;
     }
+    log << "headroom: " << analysis.freePages << " free pages, " << analysis.deletedPages
+        << " deleted; largest new file " << room << " bytes" << std::endl;
+    return 0;
+}
 
-    spiffs_file dst = SPIFFS_open(&s_fs, name, SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
-    spiffs_update_meta(&s_fs, dst, SPIFFS_TYPE_FILE);
+/**
+ * @brief Check that a packed image keeps s_spareBlocks blocks erased, but
+ *        for the erase count and magic in their lookup pages, so that
+ *        the first writes on the device find free blocks without
+ *        garbage collection erasing any.
+ */
+static int checkSpareBlocks(Image& img, std::ostream& log) {
+    mkspiffs::Analysis analysis;
+    if (!img.analyze(analysis)) {
+        return 1;
+    }
+    size_t spare = 0;
+    size_t dataOffset = analysis.lookupPagesPerBlock * s_pageSize;
+    for (size_t bix = 0; bix < analysis.blocks.size(); ++bix) {
+        if (analysis.blocks[bix].used == 0 && analysis.blocks[bix].deleted == 0 &&
+            pageErased(img.data() + bix * s_blockSize + dataOffset, s_blockSize - dataOffset)) {
+            spare++;
+        }
+    }
+    log << spare << " erased spare blocks" << std::endl;
+    if (spare < (size_t)s_spareBlocks) {
+        std::cerr << "error: " << s_spareBlocks << " erased spare blocks wanted, the image has room for "
+                  << spare << std::endl;
+        return 1;
+    }
+    return 0;
+}
 
-    // read file size
-    fseek(src, 0, SEEK_END);
-    size_t size = ftell(src);
-    fseek(src, 0, SEEK_SET);
+// Image cache
+//
+// With --cache, created images are kept in a directory, each under a key
+// hashing everything it depends on: the mkspiffs version, the spiffs
+// configuration built in, the geometry, layout options and wear profile,
+// the name, size, modification time and contents of every source file in
+// collected order, and the files --order places first. An image whose key
+// is found there is copied, or hard linked with --cache-link, instead of
+// being built. Entries hold images as packed; --trim and --ranges are
+// applied to the copy. Entries are read-only, and every image writer
+// replaces its output file instead of writing into it, so a linked
+// output never changes the entry behind it.
 
-    if (s_debugLevel > 0) {
-        std::cout << "file size: " << size << std::endl;
+/**
+ * @brief Hash the contents of source files on s_jobs threads.
+ * @param hashes Set to the hash of each file, HASH_INIT for directories.
+ */
+static bool hashSources(const std::vector<SourceFile>& files, std::vector<uint64_t>& hashes) {
+    hashes.assign(files.size(), HASH_INIT);
+    size_t workers = s_jobs > 0 ? s_jobs : std::thread::hardware_concurrency();
+    workers = std::max((size_t)1, std::min(workers, files.size()));
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> ok(true);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < files.size(); ) {
+            if (!files[i].isDir && !mkspiffs::hashSourceFile(files[i], &hashes[i])) {
+                std::cerr << "error: failed to read " << files[i].path << std::endl;
+                ok = false;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i) {
+        threads.push_back(std::thread(worker));
     }
+    worker();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    return ok;
+}
 
-    size_t left = size;
-    uint8_t data_byte;
-    while (left > 0){
-        if (1 != fread(&data_byte, 1, 1, src)) {
-            std::cerr << "fread error!" << std::endl;
+/**
+ * @brief Compute the cache key of the image the files would be packed into.
+ */
+static bool cacheKey(const std::vector<SourceFile>& files, const std::vector<std::string>& placed, std::string* key) {
+    std::vector<uint64_t> hashes;
+    if (!hashSources(files, hashes)) {
+        return false;
+    }
 
-            fclose(src);
-            SPIFFS_close(&s_fs, dst);
-            return 1;
+    std::ostringstream desc;
+    desc << "mkspiffs " << VERSION << "\n"
+         << "name_len " << SPIFFS_OBJ_NAME_LEN << " meta_len " << SPIFFS_OBJ_META_LEN
+         << " magic " << SPIFFS_USE_MAGIC << " magic_length " << SPIFFS_USE_MAGIC_LENGTH
+         << " aligned_ix " << SPIFFS_ALIGNED_OBJECT_INDEX_TABLES
+#ifdef CONFIG_SPIFFS_USE_MTIME
+         << " mtime"
+#endif
+#ifdef CONFIG_SPIFFS_USE_DIR
+         << " dir"
+#endif
+         << "\n"
+         << "size " << s_imageSize << " page " << s_pageSize << " block " << s_blockSize
+         << " direct " << s_directLayout << " name_index " << s_nameIndex
+         << " min_size " << s_minSize << " headroom " << (s_minSize ? s_headroom : 0)
+         << " plan " << s_plan << "\n";
+    for (size_t i = 0; i < files.size(); ++i) {
+        desc << files[i].name << '\t' << (files[i].isDir ? 'd' : 'f') << '\t' << files[i].size
+#ifdef CONFIG_SPIFFS_USE_MTIME
+             << '\t' << files[i].mtime
+#endif
+             << '\t' << std::hex << hashes[i] << std::dec << '\n';
+    }
+    for (size_t i = 0; i < placed.size(); ++i) {
+        desc << "first\t" << placed[i] << '\n';
+    }
+    if (!s_wearName.empty()) {
+        std::vector<uint8_t> profile;
+        if (!readFile(s_wearName, profile)) {
+            return false;
         }
-        int res = SPIFFS_write(&s_fs, dst, &data_byte, 1);
-        if (res < 0) {
-            std::cerr << "SPIFFS_write error(" << s_fs.err_code << "): ";
-
-            if (s_fs.err_code == SPIFFS_ERR_FULL) {
-                std::cerr << "File system is full." << std::endl;
-            } else {
-                std::cerr << "unknown";
-            }
-            std::cerr << std::endl;
+        desc << "wear\t" << std::hex << hashUpdate(HASH_INIT, profile.empty() ? NULL : &profile[0], profile.size())
+             << std::dec << '\n';
+    }
+    std::string text = desc.str();
+    std::ostringstream hex;
+    hex << std::hex << std::setw(16) << std::setfill('0')
+        << hashUpdate(HASH_INIT, (const uint8_t*)text.data(), text.size());
+    *key = hex.str();
+    return true;
+}
 
-            if (s_debugLevel > 0) {
-                std::cout << "data left: " << left << std::endl;
-            }
+static bool fileExists(const std::string& path) {
+    struct stat path_stat;
+    return stat(path.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode);
+}
 
-            fclose(src);
-            SPIFFS_close(&s_fs, dst);
+/**
+ * @brief Produce the image from a cache entry: to stdout, as a hard link
+ *        or as a copy, then trimmed and range listed like a built one.
+ * @return 0 success, 1 error
+ */
+static int cacheFetch(const std::string& entry, std::ostream& log) {
+    std::vector<uint8_t> image;
+    bool linked = false;
+#if !defined(_WIN32)
+    if (s_cacheLink && !s_trim && s_imageName != "-") {
+        remove(s_imageName.c_str());
+        linked = link(entry.c_str(), s_imageName.c_str()) == 0;
+    }
+#endif
+    if (!linked && !readFile(entry, image)) {
+        return 1;
+    }
+    if (s_minSize) {
+        struct stat path_stat;
+        if (!linked) {
+            s_imageSize = (int)image.size();
+        } else if (stat(entry.c_str(), &path_stat) == 0) {
+            s_imageSize = (int)path_stat.st_size;
+        } else {
+            std::cerr << "error: failed to read " << entry << std::endl;
             return 1;
         }
-        left -= 1;
+        log << "minimal image size: " << s_imageSize << std::endl;
+    }
+    if (s_plan || s_spareBlocks > 0) {
+        // the key leaves out --spare-blocks, so the check runs on every hit
+        Image cached(s_imageSize, s_pageSize, s_blockSize);
+        imageSetup(cached, &log, &std::cerr);
+        if (!cached.open(entry, mkspiffs::IMAGE_READ)) {
+            return 1;
+        }
+        if (s_plan && reportHeadroom(cached, log) != 0) {
+            return 1;
+        }
+        if (s_spareBlocks > 0 && checkSpareBlocks(cached, log) != 0) {
+            return 1;
+        }
+    }
+    if (s_imageName == "-") {
+        return writeStdout(image.empty() ? NULL : &image[0], image.size(), log);
+    }
+    if (!linked && !writeFile(s_imageName, image.empty() ? NULL : &image[0], image.size())) {
+        return 1;
+    }
+    if (s_trim || !s_rangesName.empty()) {
+        return writeSparse(s_imageName, log);
     }
-
-    SPIFFS_close(&s_fs, dst);
-    fclose(src);
-
     return 0;
 }
 
-int addFiles(const char* dirname, const char* subPath) {
-    DIR *dir;
-    struct dirent *ent;
-    bool error = false;
-    std::string dirPath = dirname;
-    dirPath += subPath;
-
-    // Open directory
-    if ((dir = opendir (dirPath.c_str())) != NULL) {
-
-        // Read files from directory.
-        while ((ent = readdir (dir)) != NULL) {
+/**
+ * @brief Add a built image to the cache.
+ *
+ * The entry is written under a temporary name and renamed, so concurrent
+ * builds never see a partial one. Failing to add it is not an error.
+ */
+static void cacheInsert(const std::string& entry, const uint8_t* image, size_t size) {
+#if defined(_WIN32)
+    _mkdir(s_cacheDir.c_str());
+#else
+    mkdir(s_cacheDir.c_str(), S_IRWXU | S_IXGRP | S_IRGRP | S_IROTH | S_IXOTH);
+#endif
+    std::ostringstream tmp;
+    tmp << entry << ".tmp" << getpid();
+#if defined(_WIN32)
+    bool ok = writeFile(tmp.str(), image, size) && _chmod(tmp.str().c_str(), _S_IREAD) == 0;
+#else
+    bool ok = writeFile(tmp.str(), image, size) && chmod(tmp.str().c_str(), S_IRUSR | S_IRGRP | S_IROTH) == 0;
+#endif
+    if (!ok || rename(tmp.str().c_str(), entry.c_str()) != 0) {
+        remove(tmp.str().c_str());
+        std::cerr << "warning: failed to add the image to the cache" << std::endl;
+    }
+}
 
-            // Ignore dir itself.
-            if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) {
-                continue;
-            }
+int actionPack() {
+    std::vector<SourceFile> files;
+    if (!collectSource(files)) {
+        return 1;
+    }
 
-            if (!s_addAllFiles) {
-                bool skip = false;
-                size_t ignored_file_names_count = sizeof(ignored_file_names) / sizeof(ignored_file_names[0]);
-                for (size_t i = 0; i < ignored_file_names_count; ++i) {
-                    if (strcmp(ent->d_name, ignored_file_names[i]) == 0) {
-                        std::cerr << "skipping " << ent->d_name << std::endl;
-                        skip = true;
-                        break;
-                    }
-                }
-                if (skip) {
-                    continue;
-                }
-            }
+    // With the image going to stdout, messages go to stderr
+    bool toStdout = s_imageName == "-";
+    std::ostream& log = toStdout ? std::cerr : std::cout;
 
-            std::string fullpath = dirPath;
-            fullpath += ent->d_name;
-            struct stat path_stat;
-            stat (fullpath.c_str(), &path_stat);
+    std::vector<std::string> placed;
+    if (!s_orderName.empty() && !mkspiffs::readAccessOrder(s_orderName, files, placed)) {
+        std::cerr << "error: failed to read " << s_orderName << std::endl;
+        return 1;
+    }
 
-            if (!S_ISREG(path_stat.st_mode)) {
-                // Check if path is a directory.
-                if (S_ISDIR(path_stat.st_mode)) {
-#ifdef CONFIG_SPIFFS_USE_DIR
-                    std::string dirpath = subPath;
-                    dirpath += ent->d_name;
-                    std::cout << dirpath << " [D]"  << std::endl;
-                    spiffs_file dst = SPIFFS_open(&s_fs, (char*)dirpath.c_str(), SPIFFS_CREAT | SPIFFS_WRONLY, 0);
-                    if (dst < 0) {
-                        std::cerr << "error adding directory (open)!" << std::endl;
-                        error = true;
-                        if (s_debugLevel > 0) {
-                            std::cout << std::endl;
-                        }
-                        break;
-                    }
-                    spiffs_update_meta(&s_fs, dst, SPIFFS_TYPE_DIR);
-                    if (SPIFFS_close(&s_fs, dst) < 0) {
-                        std::cerr << "error adding directory (close)!" << std::endl;
-                        error = true;
-                        if (s_debugLevel > 0) {
-                            std::cout << std::endl;
-                        }
-                        break;
-                    }
-#endif
-                    // Prepare new sub path.
-                    std::string newSubPath = subPath;
-                    newSubPath += ent->d_name;
-                    newSubPath += "/";
+    std::string cacheEntry;
+    if (!s_cacheDir.empty()) {
+        std::string key;
+        if (!cacheKey(files, placed, &key)) {
+            return 1;
+        }
+        cacheEntry = s_cacheDir + "/" + key + ".bin";
+        if (fileExists(cacheEntry)) {
+            log << "cache hit " << key << std::endl;
+            return cacheFetch(cacheEntry, log);
+        }
+        log << "cache miss " << key << std::endl;
+    }
 
-                    if (addFiles(dirname, newSubPath.c_str()) != 0)
-                    {
-                        std::cerr << "Error for adding content from " << ent->d_name << "!" << std::endl;
-                    }
+    if (s_plan && !planOrder(files, log)) {
+        return 1;
+    }
+    if (!s_orderName.empty()) {
+        mkspiffs::placeFirst(files, placed);
+        if (s_debugLevel > 0) {
+            log << placed.size() << " files placed first" << std::endl;
+        }
+    }
 
-                    continue;
-                }
-                else
-                {
-                    std::cerr << "skipping " << ent->d_name << std::endl;
-                    continue;
-                }
-            }
+    if (s_minSize) {
+        if (!minimalImageSize(files, &s_imageSize)) {
+            return 1;
+        }
+        log << "minimal image size: " << s_imageSize << std::endl;
+    }
 
-            // Filepath with dirname as root folder.
-            std::string filepath = subPath;
-            filepath += ent->d_name;
-            std::cout << filepath << std::endl;
-
-            // Add File to image.
-            if (addFile((char*)filepath.c_str(), fullpath.c_str()) != 0) {
-                std::cerr << "error adding file!" << std::endl;
-                error = true;
-                if (s_debugLevel > 0) {
-                    std::cout << std::endl;
-                }
-                break;
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &log, &std::cerr);
+    if (!s_wearName.empty()) {
+        std::vector<spiffs_obj_id> counts;
+        std::string error;
+        if (!mkspiffs::readWearProfile(s_wearName, s_imageSize / s_blockSize, counts, error)) {
+            std::cerr << "error: " << error << std::endl;
+            return 1;
+        }
+        img.setEraseCounts(counts);
+    }
+    int result = packImage(img, s_imageName, files, log);
+    if (result == 0 && (s_plan || s_spareBlocks > 0)) {
+        // an image file is closed by now; look at it through a read-only copy
+        Image packed(s_imageSize, s_pageSize, s_blockSize);
+        Image* check = &img;
+        if (!toStdout) {
+            imageSetup(packed, &log, &std::cerr);
+            result = packed.open(s_imageName, mkspiffs::IMAGE_READ) ? 0 : 1;
+            check = &packed;
+        }
+        if (result == 0 && s_plan) {
+            result = reportHeadroom(*check, log);
+        }
+        if (result == 0 && s_spareBlocks > 0) {
+            result = checkSpareBlocks(*check, log);
+        }
+    }
+    if (result == 0 && !cacheEntry.empty()) {
+        if (toStdout) {
+            cacheInsert(cacheEntry, img.data(), img.size());
+        } else {
+            std::vector<uint8_t> image;
+            if (readFile(s_imageName, image)) {
+                cacheInsert(cacheEntry, image.empty() ? NULL : &image[0], image.size());
             }
-        } // end while
-        closedir (dir);
-    } else {
-        std::cerr << "warning: can't read source directory" << std::endl;
-        return 1;
+        }
     }
-
-    return (error) ? 1 : 0;
+    if (result == 0 && toStdout) {
+        result = writeStdout(img.data(), img.size(), log);
+    } else if (result == 0 && (s_trim || !s_rangesName.empty())) {
+        result = writeSparse(s_imageName, log);
+    }
+    return result;
 }
 
-void listFiles() {
-    spiffs_DIR dir;
-    spiffs_dirent ent;
-    //struct stat sb = {0};
+int actionUpdate() {
+    std::vector<SourceFile> files;
+    if (!collectSource(files)) {
+        return 1;
+    }
 
-    SPIFFS_opendir(&s_fs, 0, &dir);
-    spiffs_dirent* it;
-    while (true) {
-        it = SPIFFS_readdir(&dir, &ent);
-        if (!it)
-            break;
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
+    bool ok = img.open(s_imageName, mkspiffs::IMAGE_UPDATE) && img.update(files);
+    if (!img.close()) {
+        ok = false;
+    }
 
-        //get_spiffs_stat((const char *)it->name, &sb);
-        //std::cout << sb.st_mode << '\t' << it->size << '\t' << it->name << std::endl;
-        std::cout << it->size << '\t' << it->name << std::endl;
+    if (s_debugLevel > 0) {
+        printThroughput(std::cout, "total written", img.importedBytes(), img.importSeconds());
     }
-    SPIFFS_closedir(&dir);
+
+    return ok ? 0 : 1;
 }
 
 /**
- * @brief Check if directory exists.
- * @param path Directory path.
- * @return True if exists otherwise false.
+ * @brief Check an image against its source tree without unpacking it.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * The image files are read through SPIFFS_read and hashed on one thread
+ * while the sources are hashed on s_jobs others. Directories aren't
+ * compared, as unpacking creates them from the file paths anyway.
+ * @return 0 if every file matches, 1 otherwise
  */
-bool dirExists(const char* path) {
-    DIR *d = opendir(path);
+int actionVerify() {
+    std::vector<SourceFile> sources;
+    if (!collectSource(sources)) {
+        return 1;
+    }
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
+    std::vector<FileInfo> files;
+    if (!img.open(s_imageName, mkspiffs::IMAGE_READ) || !img.list(files)) {
+        return 1;
+    }
 
-    if (d) {
-        closedir(d);
-        return true;
+    std::vector<uint64_t> imageHashes;
+    bool imageOk = false;
+    double imageSeconds = 0;
+    std::thread reader([&]() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        imageOk = img.hashFiles(files, imageHashes);
+        imageSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    });
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<uint64_t> sourceHashes;
+    bool sourcesOk = hashSources(sources, sourceHashes);
+    double sourceSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    reader.join();
+    if (!imageOk || !sourcesOk) {
+        return 1;
     }
 
-    return false;
+    std::map<std::string, size_t> inImage;
+    size_t imageBytes = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+#if SPIFFS_NAME_INDEX
+        if (files[i].name == SPIFFS_NAME_INDEX_FILE) {
+            continue;   // image metadata
+        }
+#endif
+        if (!files[i].isDir) {
+            inImage[files[i].name] = i;
+            imageBytes += files[i].size;
+        }
+    }
+    size_t checked = 0, differ = 0, missing = 0, sourceBytes = 0;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        if (sources[i].isDir) {
+            continue;
+        }
+        checked++;
+        sourceBytes += sources[i].size;
+        std::map<std::string, size_t>::iterator it = inImage.find(sources[i].name);
+        if (it == inImage.end()) {
+            std::cout << "missing " << sources[i].name << std::endl;
+            missing++;
+            continue;
+        }
+        if (files[it->second].size != sources[i].size || imageHashes[it->second] != sourceHashes[i]) {
+            std::cout << "differs " << sources[i].name << std::endl;
+            differ++;
+        }
+        inImage.erase(it);
+    }
+    for (std::map<std::string, size_t>::iterator it = inImage.begin(); it != inImage.end(); ++it) {
+        std::cout << "extra " << it->first << std::endl;
+    }
+
+    std::cout << "verified " << checked << " files: " << differ << " differ, " << missing << " missing, "
+              << inImage.size() << " extra" << std::endl;
+    printThroughput(std::cout, "image read", imageBytes, imageSeconds);
+    printThroughput(std::cout, "sources hashed", sourceBytes, sourceSeconds);
+    return differ == 0 && missing == 0 && inImage.empty() ? 0 : 1;
 }
 
+// One image of a --batch manifest
+struct BatchJob {
+    std::string imageName;
+    std::string dirName;
+    int imageSize;
+    int pageSize;
+    int blockSize;
+    std::vector<SourceFile> files;
+    int result;
+    std::string out;    // messages, printed once the image is done
+    std::string err;
+};
+
 /**
- * @brief Create directory if it not exists.
- * @param path Directory path.
+ * @brief Read a batch manifest.
+ * @param path Manifest file.
+ * @param jobs One entry per image is appended here.
  * @return True or false.
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * Every line names an image file and its source directory, optionally
+ * followed by sizes that override -s, -p and -b for that image:
+ *
+ *     image_file pack_dir [size [page [block]]]
+ *
+ * Empty lines and lines starting with '#' are skipped.
  */
-bool dirCreate(const char* path) {
-    // Check if directory also exists.
-    if (dirExists(path)) {
-	    return false;
+static bool readManifest(const std::string& path, std::vector<BatchJob>& jobs) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        std::cerr << "error: failed to open " << path << std::endl;
+        return false;
     }
 
-    // platform stuff...
-#if defined(_WIN32)
-    if (_mkdir(path) != 0) {
-#else
-    if (mkdir(path, S_IRWXU | S_IXGRP | S_IRGRP | S_IROTH | S_IXOTH) != 0) {
-#endif
-	    std::cerr << "Can not create directory!!!" << std::endl;
-		return false;
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo) {
+        std::istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.imageName) || job.imageName[0] == '#') {
+            continue;
+        }
+        job.imageSize = s_imageSize;
+        job.pageSize = s_pageSize;
+        job.blockSize = s_blockSize;
+        job.result = 1;
+
+        int* sizes[] = {&job.imageSize, &job.pageSize, &job.blockSize};
+        bool ok = !!(fields >> job.dirName);
+        std::string value;
+        for (size_t i = 0; ok && i < 3 && fields >> value; ++i) {
+            char* end;
+            *sizes[i] = (int)strtol(value.c_str(), &end, 0);
+            ok = (*end == 0 && *sizes[i] > 0);
+        }
+        if (!ok || fields >> value) {
+            std::cerr << "error: " << path << ":" << lineNo
+                      << ": expected image_file pack_dir [size [page [block]]]" << std::endl;
+            return false;
+        }
+        jobs.push_back(job);
     }
-
     return true;
 }
 
+static void runBatchJob(BatchJob& job, SourceCache* sources) {
+    std::ostringstream out, err;
+    Image img(job.imageSize, job.pageSize, job.blockSize);
+    imageSetup(img, &out, &err);
+    img.setSourceCache(sources);
+    job.result = packImage(img, job.imageName, job.files, out);
+    job.out = out.str();
+    job.err = err.str();
+}
+
 /**
- * @brief Unpack file from file system.
- * @param spiffsFile SPIFFS dir entry pointer.
- * @param destPath Destination file path path.
- * @return True or false.
+ * @brief Build every image of the manifest, several at a time.
+ * @return 0 if all images were built, 1 otherwise
  *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * Each image gets its own Image and spiffs instance. Source files that go
+ * into more than one image are read from disk only once.
  */
-bool unpackFile(spiffs_dirent *spiffsFile, const char *destPath) {
-    u8_t buffer[spiffsFile->size];
-    std::string filename = (const char*)(spiffsFile->name);
-
-    // Open file from spiffs file system.
-    spiffs_file src = SPIFFS_open(&s_fs, (char *)(filename.c_str()), SPIFFS_RDONLY, 0);
+int actionBatch() {
+    std::vector<BatchJob> jobs;
+    if (!readManifest(s_manifestName, jobs)) {
+        return 1;
+    }
 
-    // read content into buffer
-    SPIFFS_read(&s_fs, src, buffer, spiffsFile->size);
+    std::map<std::string, int> users;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (!mkspiffs::collectFiles(jobs[i].dirName, jobs[i].files, s_addAllFiles, &std::cerr)) {
+            std::cerr << "error: can't read source directory " << jobs[i].dirName << std::endl;
+            return 1;
+        }
+        for (size_t j = 0; j < jobs[i].files.size(); ++j) {
+            if (!jobs[i].files[j].isDir) {
+                users[jobs[i].files[j].path]++;
+            }
+        }
+    }
+    SourceCache sources;
+    for (std::map<std::string, int>::iterator it = users.begin(); it != users.end(); ++it) {
+        if (it->second > 1) {
+            sources.share(it->first, it->second);
+        }
+    }
 
-    // Close spiffs file.
-    SPIFFS_close(&s_fs, src);
+    size_t workers = s_jobs > 0 ? s_jobs : std::thread::hardware_concurrency();
+    workers = std::max((size_t)1, std::min(workers, jobs.size()));
 
-    // Open file.
-    FILE* dst = fopen(destPath, "wb");
+    std::atomic<size_t> next(0);
+    std::mutex outputLock;
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < jobs.size(); ) {
+            runBatchJob(jobs[i], &sources);
 
-    // Write content into file.
-    fwrite(buffer, sizeof(u8_t), sizeof(buffer), dst);
+            std::lock_guard<std::mutex> lock(outputLock);
+            std::cout << jobs[i].out;
+            std::cerr << jobs[i].err;
+            std::cout << jobs[i].imageName << (jobs[i].result == 0 ? ": done" : ": failed") << std::endl;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
 
-    // Close file.
-    fclose(dst);
+    size_t built = 0;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (jobs[i].result == 0) {
+            built++;
+        }
+    }
+    std::cout << "built " << built << " of " << jobs.size() << " images" << std::endl;
+    return built == jobs.size() ? 0 : 1;
+}
 
+// One geometry tried by --tune
+struct TuneConfig {
+    int imageSize;
+    int pageSize;
+    int blockSize;
+    bool ok;            // packed, checked, and garbage collection still has room
+    double fill;        // used pages over all data pages
+    size_t metaBytes;   // page headers, index, lookup pages and slack
+    size_t readOps;     // HAL reads to open and read every file
+    size_t readBytes;
+    std::string error;
+};
 
-    return true;
+static void runTuneConfig(TuneConfig& config, const std::vector<SourceFile>& files, SourceCache* sources) {
+    std::ostringstream err;
+    Image img(config.imageSize, config.pageSize, config.blockSize);
+    img.setLog(NULL, &err);
+    img.setDirectLayout(s_directLayout);
+    img.setNameIndex(s_nameIndex);
+    img.setSourceCache(sources);
+
+    mkspiffs::Analysis analysis;
+    config.ok = img.create() && img.pack(files) && img.analyze(analysis) && img.readAll();
+    if (!config.ok) {
+        config.error = img.error();
+        return;
+    }
+    size_t dataPages = analysis.blockCount * (analysis.pagesPerBlock - analysis.lookupPagesPerBlock);
+    config.fill = (double)analysis.usedPages / dataPages;
+    config.metaBytes = analysis.pageHeaderBytes + analysis.indexBytes + analysis.lookupBytes + analysis.slackBytes;
+    config.readOps = img.readOps();
+    config.readBytes = img.readBytes();
+    if (analysis.gcPressure >= 1) {
+        config.ok = false;
+        config.error = "no room left for garbage collection";
+    }
 }
 
 /**
- * @brief Unpack files from file system.
- * @param sDest Directory path as std::string.
- * @return True or false.
- *
- * @author Pascal Gollor (http://www.pgollor.de/cms/)
+ * @brief Pack the source tree with a sweep of geometries and recommend one.
+ * @return 0 if some geometry fits the image size, 1 otherwise
  *
- * todo: Do unpack stuff for directories.
+ * Page sizes from 256 to 2048 bytes and block sizes from 4 to 64 KiB are
+ * tried at the -s image size and at a half and a quarter of it, as long as
+ * a block holds at least 8 pages, the image at least 4 blocks and page
+ * indices fit in 16 bits. Every geometry is packed in memory and its read
+ * cost measured by opening and reading every file after a fresh mount. Of
+ * the geometries that fit the full image size, the one needing the fewest
+ * flash reads is recommended, then the fewest bytes read.
  */
-bool unpackFiles(std::string sDest) {
-    spiffs_DIR dir;
-    spiffs_dirent ent;
-
-    // Add "./" to path if is not given.
-    if (sDest.find("./") == std::string::npos && sDest.find("/") == std::string::npos) {
-        sDest = "./" + sDest;
-    }
-
-    // Check if directory exists. If it does not then try to create it with permissions 755.
-    if (! dirExists(sDest.c_str())) {
-        std::cout << "Directory " << sDest << " does not exists. Try to create it." << std::endl;
-
-        // Try to create directory.
-        if (! dirCreate(sDest.c_str())) {
-            return false;
-        }
+int actionTune() {
+    std::vector<SourceFile> files;
+    if (!collectSource(files)) {
+        return 1;
     }
 
-    // Open directory.
-    SPIFFS_opendir(&s_fs, 0, &dir);
-
-    // Read content from directory.
-    spiffs_dirent* it = SPIFFS_readdir(&dir, &ent);
-    while (it) {
-        // Check if content is a file.
-        if ((int)(it->type) == 1) {
-            std::string name = (const char*)(it->name);
-            std::string sDestFilePath = sDest + name;
-            size_t pos = name.find_first_of("/", 1);
-
-            // If file is in sub directories?
-            while (pos != std::string::npos) {
-                // Subdir path.
-                std::string path = sDest;
-                path += name.substr(0, pos);
-
-                // Create subddir if subdir not exists.
-                if (!dirExists(path.c_str())) {
-                    if (!dirCreate(path.c_str())) {
-                        return false;
-                    }
+    std::vector<TuneConfig> configs;
+    for (int pageSize = 256; pageSize <= 2048; pageSize *= 2) {
+        for (int blockSize = 4096; blockSize <= 65536; blockSize *= 2) {
+            for (int imageSize = s_imageSize; imageSize > 0 && imageSize >= s_imageSize / 4; imageSize /= 2) {
+                if (blockSize / pageSize < 8 || imageSize % blockSize != 0 ||
+                    imageSize / blockSize < 4 || imageSize / pageSize > 0x10000) {
+                    continue;
                 }
-
-                pos = name.find_first_of("/", pos + 1);
-            }
-
-            // Unpack file to destination directory.
-            if (! unpackFile(it, sDestFilePath.c_str()) ) {
-                std::cout << "Can not unpack " << it->name << "!" << std::endl;
-                return false;
+                TuneConfig config = TuneConfig();
+                config.imageSize = imageSize;
+                config.pageSize = pageSize;
+                config.blockSize = blockSize;
+                configs.push_back(config);
             }
-
-            // Output stuff.
-            std::cout
-                << it->name
-                << '\t'
-                << " > " << sDestFilePath
-                << '\t'
-                << "size: " << it->size << " Bytes"
-                << std::endl;
         }
+    }
+    if (configs.empty()) {
+        std::cerr << "error: no geometry to try for an image of " << s_imageSize << " bytes" << std::endl;
+        return 1;
+    }
 
-        // Get next file handle.
-        it = SPIFFS_readdir(&dir, &ent);
-    } // end while
-
-    // Close directory.
-    SPIFFS_closedir(&dir);
+    SourceCache sources;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].isDir && !files[i].data) {
+            sources.share(files[i].path, (int)configs.size());
+        }
+    }
 
-    return true;
-}
+    size_t workers = s_jobs > 0 ? s_jobs : std::thread::hardware_concurrency();
+    workers = std::max((size_t)1, std::min(workers, configs.size()));
 
-// Actions
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < configs.size(); ) {
+            runTuneConfig(configs[i], files, &sources);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
 
-int actionPack() {
-    if (!dirExists(s_dirName.c_str())) {
-        std::cerr << "error: can't read source directory" << std::endl;
-        return 1;
+    const TuneConfig* best = NULL;
+    std::cout << "    page   block      size   fill   meta  reads  read_bytes" << std::endl;
+    for (size_t i = 0; i < configs.size(); ++i) {
+        const TuneConfig& c = configs[i];
+        std::cout << std::setw(8) << c.pageSize << std::setw(8) << c.blockSize << std::setw(10) << c.imageSize;
+        if (!c.ok) {
+            std::cout << "  " << c.error << std::endl;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(6) << c.fill * 100 << "%"
+                  << std::setw(6) << (double)c.metaBytes * 100 / c.imageSize << "%"
+                  << std::setw(7) << c.readOps << std::setw(12) << c.readBytes << std::endl;
+        if (c.imageSize == s_imageSize && (!best || c.readOps < best->readOps ||
+            (c.readOps == best->readOps && c.readBytes < best->readBytes))) {
+            best = &c;
+        }
     }
-    
-    s_flashmem.resize(s_imageSize, 0xff);
 
-    FILE* fdres = fopen(s_imageName.c_str(), "wb");
-    if (!fdres) {
-        std::cerr << "error: failed to open image file" << std::endl;
+    if (!best) {
+        std::cerr << "error: the files do not fit an image of " << s_imageSize << " bytes" << std::endl;
         return 1;
     }
-
-    spiffsFormat();
-    int result = addFiles(s_dirName.c_str(), "/");
-    //listFiles();
-    spiffsUnmount();
-
-    fwrite(&s_flashmem[0], 4, s_flashmem.size()/4, fdres);
-    fclose(fdres);
-
-    return result;
+    std::cout << "recommended: -s " << best->imageSize << " -p " << best->pageSize << " -b " << best->blockSize << std::endl;
+    return 0;
 }
 
 /**
@@ -582,106 +1141,286 @@ int actionPack() {
  * @author Pascal Gollor (http://www.pgollor.de/cms/)
  */
 int actionUnpack(void) {
-    int ret = 0;
-    s_flashmem.resize(s_imageSize, 0xff);
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
 
-    // open spiffs image
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
-        return 1;
+    // Add "./" to path if is not given.
+    std::string dest = s_dirName;
+    if (dest.find("./") == std::string::npos && dest.find("/") == std::string::npos) {
+        dest = "./" + dest;
     }
 
-    // read content into s_flashmem
-    ret = fread(&s_flashmem[0], 4, s_flashmem.size()/4, fdsrc);
+    bool ok = img.open(s_imageName, mkspiffs::IMAGE_READ) && img.unpack(dest, s_jobs);
+    img.close();
+    return ok ? 0 : 1;
+}
 
-    // close fiel handle
-    fclose(fdsrc);
 
-    // mount file system
-    spiffsMount();
+int actionList() {
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
 
-    // unpack files
-    if (! unpackFiles(s_dirName)) {
-        ret = 1;
+    std::vector<FileInfo> files;
+    if (!img.open(s_imageName, mkspiffs::IMAGE_READ) || !img.list(files)) {
+        return 1;
     }
+    for (size_t i = 0; i < files.size(); ++i) {
+        std::cout << files[i].size << '\t' << files[i].name << std::endl;
+    }
+    return 0;
+}
 
-    // unmount file system
-    spiffsUnmount();
+int actionAnalyze() {
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
 
-    return ret;
+    mkspiffs::Analysis analysis;
+    if (!img.open(s_imageName, mkspiffs::IMAGE_READ) || !img.analyze(analysis)) {
+        return 1;
+    }
+    mkspiffs::writeAnalysisJson(std::cout, analysis);
+    return 0;
 }
 
+int actionSimulate() {
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
 
-int actionList() {
-    s_flashmem.resize(s_imageSize, 0xff);
+    mkspiffs::Simulation simulation;
+    if (!img.open(s_imageName, mkspiffs::IMAGE_READ) || !img.simulate(simulation)) {
+        return 1;
+    }
+    mkspiffs::writeSimulationJson(std::cout, simulation, s_flashTiming);
+    return 0;
+}
+
+int actionVisualize() {
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
+    return img.open(s_imageName, mkspiffs::IMAGE_READ) && img.visualize(std::cout) ? 0 : 1;
+}
 
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
+/**
+ * @brief Write the delta that turns the --base image into the image file.
+ * @return 0 success, 1 error
+ */
+int actionDiff() {
+    std::vector<uint8_t> base;
+    Image img(s_imageSize, s_pageSize, s_blockSize);
+    imageSetup(img, &std::cout, &std::cerr);
+    if (!readBaseImage(base) || !img.open(s_imageName, mkspiffs::IMAGE_READ)) {
         return 1;
     }
+    const uint8_t* image = img.data();
+
+    size_t pagesPerBlock = s_blockSize / s_pageSize;
+    size_t bitmapSize = (pagesPerBlock + 7) / 8;
+    size_t blockCount = img.size() / s_blockSize;
+
+    std::vector<uint8_t> delta;
+    putU32(delta, s_deltaMagic);
+    putU32(delta, s_deltaVersion);
+    putU32(delta, img.size());
+    putU32(delta, s_blockSize);
+    putU32(delta, s_pageSize);
+    putU64(delta, hashUpdate(HASH_INIT, image, img.size()));
+    size_t blockCountPos = delta.size();
+    putU32(delta, 0);
+
+    uint32_t changedBlocks = 0, changedPages = 0;
+    for (size_t bix = 0; bix < blockCount; ++bix) {
+        size_t blockAddr = bix * s_blockSize;
+        if (memcmp(&base[blockAddr], image + blockAddr, s_blockSize) == 0) {
+            continue;
+        }
+        std::vector<uint8_t> changed(bitmapSize, 0), erased(bitmapSize, 0), pages;
+        for (size_t pix = 0; pix < pagesPerBlock; ++pix) {
+            size_t addr = blockAddr + pix * s_pageSize;
+            if (memcmp(&base[addr], image + addr, s_pageSize) == 0) {
+                continue;
+            }
+            changed[pix / 8] |= 1 << (pix % 8);
+            changedPages++;
+            if (pageErased(image + addr, s_pageSize)) {
+                erased[pix / 8] |= 1 << (pix % 8);
+            } else {
+                pages.insert(pages.end(), image + addr, image + addr + s_pageSize);
+            }
+        }
+        putU32(delta, bix);
+        delta.insert(delta.end(), changed.begin(), changed.end());
+        delta.insert(delta.end(), erased.begin(), erased.end());
+        delta.insert(delta.end(), pages.begin(), pages.end());
+        changedBlocks++;
+        if (s_debugLevel > 0) {
+            std::cout << "block " << bix << ": " << pages.size() / s_pageSize << " pages" << std::endl;
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        delta[blockCountPos + i] = (changedBlocks >> (8 * i)) & 0xff;
+    }
+
+    img.close();
 
-    int ret = fread(&s_flashmem[0], 4, s_flashmem.size()/4, fdsrc);
-    if (ret < 0) {
-        std::cerr << "error: failed to read from image file" << std::endl;
+    if (!writeFile(s_deltaName, &delta[0], delta.size())) {
         return 1;
     }
-    fclose(fdsrc);
-    spiffsMount();
-    listFiles();
-    spiffsUnmount();
+    std::cout << "changed blocks: " << changedBlocks << "/" << blockCount
+              << ", changed pages: " << changedPages
+              << ", delta size: " << delta.size() << " bytes" << std::endl;
     return 0;
 }
 
-int actionVisualize() {
-#if SPIFFS_TEST_VISUALISATION
-    s_flashmem.resize(s_imageSize, 0xff);
+/**
+ * @brief Apply a delta to the --base image and write the result to the image file.
+ * @return 0 success, 1 error
+ */
+int actionPatch() {
+    std::vector<uint8_t> base, delta;
+    if (!readBaseImage(base) || !readFile(s_deltaName, delta)) {
+        return 1;
+    }
 
-    FILE* fdsrc = fopen(s_imageName.c_str(), "rb");
-    if (!fdsrc) {
-        std::cerr << "error: failed to open image file" << std::endl;
+    size_t pos = 0;
+    uint32_t magic, version, imageSize, blockSize, pageSize, blockCount;
+    uint64_t hash;
+    if (!getU32(delta, pos, &magic) || magic != s_deltaMagic ||
+        !getU32(delta, pos, &version) || version != s_deltaVersion) {
+        std::cerr << "error: not a spiffs image delta" << std::endl;
+        return 1;
+    }
+    if (!getU32(delta, pos, &imageSize) || !getU32(delta, pos, &blockSize) ||
+        !getU32(delta, pos, &pageSize) || !getU64(delta, pos, &hash) ||
+        !getU32(delta, pos, &blockCount)) {
+        std::cerr << "error: truncated delta" << std::endl;
+        return 1;
+    }
+    if ((int)imageSize != s_imageSize || (int)blockSize != s_blockSize || (int)pageSize != s_pageSize) {
+        std::cerr << "error: delta was made for size " << imageSize << ", block " << blockSize
+                  << ", page " << pageSize << std::endl;
         return 1;
     }
 
-    fread(&s_flashmem[0], 4, s_flashmem.size()/4, fdsrc);
-    fclose(fdsrc);
+    size_t pagesPerBlock = blockSize / pageSize;
+    size_t bitmapSize = (pagesPerBlock + 7) / 8;
+    // every block takes its index and two bitmaps at least
+    if (blockCount > imageSize / blockSize || blockCount > (delta.size() - pos) / (4 + 2 * bitmapSize)) {
+        std::cerr << "error: truncated delta" << std::endl;
+        return 1;
+    }
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        uint32_t bix;
+        if (!getU32(delta, pos, &bix) || pos + 2 * bitmapSize > delta.size()) {
+            std::cerr << "error: truncated delta" << std::endl;
+            return 1;
+        }
+        if (bix >= imageSize / blockSize) {
+            std::cerr << "error: delta block " << bix << " is outside the image" << std::endl;
+            return 1;
+        }
+        const uint8_t* changed = &delta[pos];
+        const uint8_t* erased = &delta[pos + bitmapSize];
+        pos += 2 * bitmapSize;
+        for (size_t pix = 0; pix < pagesPerBlock; ++pix) {
+            if ((changed[pix / 8] & (1 << (pix % 8))) == 0) {
+                continue;
+            }
+            uint8_t* page = &base[(size_t)bix * blockSize + pix * pageSize];
+            if (erased[pix / 8] & (1 << (pix % 8))) {
+                memset(page, 0xff, pageSize);
+                continue;
+            }
+            if (pos + pageSize > delta.size()) {
+                std::cerr << "error: truncated delta" << std::endl;
+                return 1;
+            }
+            memcpy(page, &delta[pos], pageSize);
+            pos += pageSize;
+        }
+    }
+    if (pos != delta.size()) {
+        std::cerr << "error: " << delta.size() - pos << " bytes after the last block of the delta" << std::endl;
+        return 1;
+    }
 
-    spiffsMount();
-    SPIFFS_vis(&s_fs);
-    uint32_t total, used;
-    SPIFFS_info(&s_fs, &total, &used);
-    std::cout << "total: " << total <<  std::endl << "used: " << used << std::endl;
-    spiffsUnmount();
-#endif
+    if (hashUpdate(HASH_INIT, &base[0], base.size()) != hash) {
+        std::cerr << "error: patched image does not match the delta" << std::endl;
+        return 1;
+    }
+    if (!writeFile(s_imageName, &base[0], base.size())) {
+        return 1;
+    }
+    std::cout << "patched blocks: " << blockCount << std::endl;
     return 0;
 }
 
 void processArgs(int argc, const char** argv) {
     TCLAP::CmdLine cmd("", ' ', VERSION);
-    TCLAP::ValueArg<std::string> packArg( "c", "create", "create spiffs image from a directory", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> packArg( "c", "create", "create spiffs image from a directory, or from a tar stream on stdin if pack_dir is -", true, "", "pack_dir");
     TCLAP::ValueArg<std::string> unpackArg( "u", "unpack", "unpack spiffs image to a directory", true, "", "dest_dir");
+    TCLAP::ValueArg<std::string> updateArg( "", "update", "update an existing spiffs image from a directory (or a tar stream on stdin, for -), rewriting only files that changed", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> diffArg( "", "diff", "write the delta from the --base image to image_file", true, "", "delta_file");
+    TCLAP::ValueArg<std::string> patchArg( "", "patch", "apply a delta to the --base image, writing image_file", true, "", "delta_file");
     TCLAP::SwitchArg listArg( "l", "list", "list files in spiffs image", false);
     TCLAP::SwitchArg visualizeArg( "i", "visualize", "visualize spiffs image", false);
-    TCLAP::UnlabeledValueArg<std::string> outNameArg( "image_file", "spiffs image file", true, "", "image_file"  );
+    TCLAP::SwitchArg analyzeArg( "", "analyze", "print a JSON report of page usage and erase counts per block, fragmentation per file, space overhead and GC pressure", false);
+    TCLAP::SwitchArg simulateArg( "", "simulate", "print a JSON estimate of the flash reads and time it takes a device to mount the image, open and read every file, and stat every file", false);
+    TCLAP::ValueArg<double> flashReadArg( "", "flash-read", "flash read rate --simulate assumes, in MB/s", false, 40, "number" );
+    TCLAP::ValueArg<double> flashOverheadArg( "", "flash-overhead", "time --simulate assumes every flash read takes on top of its bytes, in microseconds", false, 10, "number" );
+    TCLAP::ValueArg<std::string> tuneArg( "", "tune", "pack a directory with a sweep of page, block and image sizes up to -s, report fill, metadata overhead and read cost of each, and recommend one", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> verifyArg( "", "verify", "check that the files of image_file match a directory (or a tar stream on stdin, for -), reporting files that differ, are missing or extra, without unpacking", true, "", "pack_dir");
+    TCLAP::ValueArg<std::string> batchArg( "", "batch", "create every image listed in a manifest, several at a time; each line reads: image_file pack_dir [size [page [block]]]", true, "", "manifest");
+    TCLAP::UnlabeledValueArg<std::string> outNameArg( "image_file", "spiffs image file; when creating an image, - writes it to stdout", false, "", "image_file"  );
     TCLAP::ValueArg<int> imageSizeArg( "s", "size", "fs image size, in bytes", false, 0x10000, "number" );
     TCLAP::ValueArg<int> pageSizeArg( "p", "page", "fs page size, in bytes", false, 256, "number" );
     TCLAP::ValueArg<int> blockSizeArg( "b", "block", "fs block size, in bytes", false, 4096, "number" );
     TCLAP::SwitchArg addAllFilesArg( "a", "all-files", "when creating an image, include files which are normally ignored; currently only applies to '.DS_Store' files and '.git' directories", false);
+    TCLAP::SwitchArg directArg( "", "direct", "when creating an image, lay out files directly in one sequential pass instead of replaying them through the spiffs API", false);
+    TCLAP::ValueArg<std::string> baseArg( "", "base", "base (old) image for --diff and --patch", false, "", "image_file");
+    TCLAP::SwitchArg hashArg( "", "hash", "when updating an image, also compare file contents, not only size and modification time", false);
+    TCLAP::SwitchArg minSizeArg( "", "min-size", "when creating an image, make it the fewest whole blocks, up to -s, that hold the files and keep --headroom blocks free", false);
+    TCLAP::ValueArg<int> headroomArg( "", "headroom", "number of free blocks --min-size leaves for garbage collection", false, 2, "number" );
+    TCLAP::SwitchArg trimArg( "", "trim", "when creating an image, leave the erased flash at its end out of the image file", false);
+    TCLAP::ValueArg<std::string> rangesArg( "", "ranges", "when creating an image, also write the offset and length of every range of it that is not erased flash", false, "", "ranges_file");
+    TCLAP::ValueArg<std::string> orderArg( "", "order", "when creating an image, place the files a hint list or boot trace mentions first, in the order of their first mention", false, "", "hint_file");
+    TCLAP::SwitchArg nameIndexArg( "", "name-index", "when creating or updating an image, add a table of name hashes that spiffs built with SPIFFS_NAME_INDEX opens files through by binary search", false);
+    TCLAP::SwitchArg planArg( "", "plan", "when creating an image, pack the files in the order, of those tried, that leaves the most room, and report the room left", false);
+    TCLAP::ValueArg<int> spareBlocksArg( "", "spare-blocks", "when creating an image, lay files out in the fewest blocks as --direct does and fail unless this many blocks stay erased; spiffs writes without garbage collecting first while more than 3 blocks are free", false, 0, "number" );
+    TCLAP::ValueArg<std::string> wearArg( "", "wear", "when creating an image, set the erase count of each block from a profile; each line reads: block|first-last|* count|min-max; blocks left out get erase count 0 unless a * line is given", false, "", "wear_profile");
+    TCLAP::ValueArg<std::string> cacheArg( "", "cache", "when creating an image, reuse the image built before from the same files, geometry and options if the cache directory holds it, else add the new one", false, "", "cache_dir");
+    TCLAP::SwitchArg cacheLinkArg( "", "cache-link", "hard link images found in the --cache instead of copying them; the image file is then read-only, and mkspiffs replaces it rather than writing into it", false);
+    TCLAP::ValueArg<int> jobsArg( "j", "jobs", "number of images --batch builds, geometries --tune tries, files --unpack extracts, or source files --cache and --verify hash, at a time; 0 means one per CPU core", false, 0, "number" );
     TCLAP::ValueArg<int> debugArg( "d", "debug", "Debug level. 0 means no debug output.", false, 0, "0-5" );
 
     cmd.add( imageSizeArg );
     cmd.add( pageSizeArg );
     cmd.add( blockSizeArg );
     cmd.add( addAllFilesArg );
+    cmd.add( directArg );
+    cmd.add( hashArg );
+    cmd.add( baseArg );
+    cmd.add( minSizeArg );
+    cmd.add( headroomArg );
+    cmd.add( trimArg );
+    cmd.add( rangesArg );
+    cmd.add( orderArg );
+    cmd.add( nameIndexArg );
+    cmd.add( flashReadArg );
+    cmd.add( flashOverheadArg );
+    cmd.add( planArg );
+    cmd.add( spareBlocksArg );
+    cmd.add( wearArg );
+    cmd.add( cacheArg );
+    cmd.add( cacheLinkArg );
+    cmd.add( jobsArg );
     cmd.add( debugArg );
-    std::vector<TCLAP::Arg*> args = {&packArg, &unpackArg, &listArg, &visualizeArg};
+    std::vector<TCLAP::Arg*> args = {&packArg, &unpackArg, &updateArg, &diffArg, &patchArg, &listArg, &visualizeArg, &analyzeArg, &batchArg, &tuneArg, &verifyArg, &simulateArg};
     cmd.xorAdd( args );
     cmd.add( outNameArg );
     cmd.parse( argc, argv );
 
     if (debugArg.getValue() > 0) {
-        std::cout << "Debug output enabled" << std::endl;
+        (outNameArg.getValue() == "-" ? std::cerr : std::cout) << "Debug output enabled" << std::endl;
         s_debugLevel = debugArg.getValue();
     }
 
@@ -691,10 +1430,32 @@ void processArgs(int argc, const char** argv) {
     } else if (unpackArg.isSet()) {
         s_dirName = unpackArg.getValue();
         s_action = ACTION_UNPACK;
+    } else if (updateArg.isSet()) {
+        s_dirName = updateArg.getValue();
+        s_action = ACTION_UPDATE;
+    } else if (diffArg.isSet()) {
+        s_deltaName = diffArg.getValue();
+        s_action = ACTION_DIFF;
+    } else if (patchArg.isSet()) {
+        s_deltaName = patchArg.getValue();
+        s_action = ACTION_PATCH;
     } else if (listArg.isSet()) {
         s_action = ACTION_LIST;
     } else if (visualizeArg.isSet()) {
         s_action = ACTION_VISUALIZE;
+    } else if (analyzeArg.isSet()) {
+        s_action = ACTION_ANALYZE;
+    } else if (batchArg.isSet()) {
+        s_manifestName = batchArg.getValue();
+        s_action = ACTION_BATCH;
+    } else if (tuneArg.isSet()) {
+        s_dirName = tuneArg.getValue();
+        s_action = ACTION_TUNE;
+    } else if (simulateArg.isSet()) {
+        s_action = ACTION_SIMULATE;
+    } else if (verifyArg.isSet()) {
+        s_dirName = verifyArg.getValue();
+        s_action = ACTION_VERIFY;
     }
 
     s_imageName = outNameArg.getValue();
@@ -702,6 +1463,28 @@ void processArgs(int argc, const char** argv) {
     s_pageSize  = pageSizeArg.getValue();
     s_blockSize = blockSizeArg.getValue();
     s_addAllFiles = addAllFilesArg.isSet();
+    s_directLayout = directArg.isSet();
+    s_compareHash = hashArg.isSet();
+    s_baseImageName = baseArg.getValue();
+    s_jobs = jobsArg.getValue();
+    s_minSize = minSizeArg.isSet();
+    s_headroom = std::max(0, headroomArg.getValue());
+    s_trim = trimArg.isSet();
+    s_rangesName = rangesArg.getValue();
+    s_orderName = orderArg.getValue();
+    s_nameIndex = nameIndexArg.isSet();
+    s_plan = planArg.isSet();
+    s_flashTiming.readMBps = flashReadArg.getValue() > 0 ? flashReadArg.getValue() : 40;
+    s_flashTiming.transactionUs = std::max(0.0, flashOverheadArg.getValue());
+    s_spareBlocks = std::max(0, spareBlocksArg.getValue());
+    if (s_spareBlocks > 0) {
+        // only the sequential layout leaves the blocks after the files untouched
+        s_directLayout = true;
+        s_headroom = std::max(s_headroom, s_spareBlocks);
+    }
+    s_cacheDir = cacheArg.getValue();
+    s_wearName = wearArg.getValue();
+    s_cacheLink = cacheLinkArg.isSet();
 }
 
 int main(int argc, const char * argv[]) {
@@ -713,6 +1496,11 @@ int main(int argc, const char * argv[]) {
         return 1;
     }
 
+    if (s_imageName.empty() && s_action != ACTION_BATCH && s_action != ACTION_TUNE) {
+        std::cerr << "error: image_file is required" << std::endl;
+        return 1;
+    }
+
     switch (s_action) {
     case ACTION_PACK:
         return actionPack();
@@ -720,12 +1508,36 @@ int main(int argc, const char * argv[]) {
     case ACTION_UNPACK:
     	return actionUnpack();
         break;
+    case ACTION_UPDATE:
+        return actionUpdate();
+        break;
+    case ACTION_DIFF:
+        return actionDiff();
+        break;
+    case ACTION_PATCH:
+        return actionPatch();
+        break;
     case ACTION_LIST:
         return actionList();
         break;
     case ACTION_VISUALIZE:
         return actionVisualize();
         break;
+    case ACTION_BATCH:
+        return actionBatch();
+        break;
+    case ACTION_ANALYZE:
+        return actionAnalyze();
+        break;
+    case ACTION_TUNE:
+        return actionTune();
+        break;
+    case ACTION_VERIFY:
+        return actionVerify();
+        break;
+    case ACTION_SIMULATE:
+        return actionSimulate();
+        break;
     default:
         break;
     }
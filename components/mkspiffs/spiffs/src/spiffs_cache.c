@@ -129,6 +129,9 @@ s32_t spiffs_phys_rd(
     u8_t *dst) {
   (void)fh;
   s32_t res = SPIFFS_OK;
+#if SPIFFS_LU_SHADOW
+  if (spiffs_lu_shadow_rd(fs, addr, len, dst)) return SPIFFS_OK;
+#endif
   spiffs_cache *cache = spiffs_get_cache(fs);
   spiffs_cache_page *cp =  spiffs_cache_page_get(fs, SPIFFS_PADDR_TO_PAGE(fs, addr));
   cache->last_access++;
@@ -181,14 +184,12 @@ s32_t spiffs_phys_rd(
 }
 
 // writes to spi flash and/or the cache
-s32_t spiffs_phys_wr(
+static s32_t spiffs_cache_wr(
     spiffs *fs,
     u8_t op,
-    spiffs_file fh,
     u32_t addr,
     u32_t len,
     u8_t *src) {
-  (void)fh;
   spiffs_page_ix pix = SPIFFS_PADDR_TO_PAGE(fs, addr);
   spiffs_cache *cache = spiffs_get_cache(fs);
   spiffs_cache_page *cp =  spiffs_cache_page_get(fs, pix);
@@ -222,6 +223,27 @@ s32_t spiffs_phys_wr(
   }
 }
 
+s32_t spiffs_phys_wr(
+    spiffs *fs,
+    u8_t op,
+    spiffs_file fh,
+    u32_t addr,
+    u32_t len,
+    u8_t *src) {
+  (void)fh;
+#if SPIFFS_SUMMARY && !SPIFFS_READ_ONLY
+  s32_t res = spiffs_summary_invalidate(fs);
+  SPIFFS_CHECK_RES(res);
+  res = spiffs_cache_wr(fs, op, addr, len, src);
+#else
+  s32_t res = spiffs_cache_wr(fs, op, addr, len, src);
+#endif
+#if SPIFFS_LU_SHADOW
+  if (res == SPIFFS_OK) spiffs_lu_shadow_wr(fs, addr, len, src);
+#endif
+  return res;
+}
+
 #if SPIFFS_CACHE_WR
 // returns the cache page that this fd refers, or null if no cache page
 spiffs_cache_page *spiffs_cache_page_get_by_fd(spiffs *fs, spiffs_fd *fd) {
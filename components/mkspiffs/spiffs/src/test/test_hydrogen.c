@@ -2429,6 +2429,646 @@ TEST_END
 
 #endif // SPIFFS_IX_MAP
 
+#if SPIFFS_NAME_INDEX
+static int name_index_entry_cmp(const void *a, const void *b) {
+  const spiffs_name_index_entry *ea = (const spiffs_name_index_entry *)a;
+  const spiffs_name_index_entry *eb = (const spiffs_name_index_entry *)b;
+  if (ea->hash != eb->hash) return ea->hash < eb->hash ? -1 : 1;
+  return ea->pix < eb->pix ? -1 : (ea->pix > eb->pix ? 1 : 0);
+}
+
+TEST(name_index)
+{
+  int res;
+  int i;
+  char name[32];
+  int file_cnt = 40;
+
+  for (i = 0; i < file_cnt; i++) {
+    sprintf(name, "file%i", i);
+    res = test_create_and_write_file(name, 100 + i * 50, 64);
+    TEST_CHECK(res >= 0);
+  }
+
+  // build the table the way an image builder would
+  spiffs_name_index_header hdr;
+  spiffs_name_index_entry entries[40];
+  spiffs_DIR d;
+  struct spiffs_dirent e;
+  struct spiffs_dirent *pe = &e;
+  hdr.magic = SPIFFS_NAME_INDEX_MAGIC;
+  hdr.count = 0;
+  SPIFFS_opendir(FS, "/", &d);
+  while ((pe = SPIFFS_readdir(&d, pe))) {
+    TEST_CHECK_LT(hdr.count, (u32_t)file_cnt);
+    entries[hdr.count].hash = spiffs_name_index_hash(pe->name);
+    entries[hdr.count].pix = pe->pix;
+    hdr.count++;
+  }
+  SPIFFS_closedir(&d);
+  TEST_CHECK_EQ(hdr.count, (u32_t)file_cnt);
+  qsort(entries, hdr.count, sizeof(spiffs_name_index_entry), name_index_entry_cmp);
+
+  spiffs_file fd = SPIFFS_open(FS, SPIFFS_NAME_INDEX_FILE, SPIFFS_O_CREAT | SPIFFS_O_TRUNC | SPIFFS_O_WRONLY, 0);
+  TEST_CHECK_GT(fd, 0);
+  TEST_CHECK_GE(SPIFFS_write(FS, fd, &hdr, sizeof(hdr)), SPIFFS_OK);
+  TEST_CHECK_GE(SPIFFS_write(FS, fd, entries, hdr.count * sizeof(spiffs_name_index_entry)), SPIFFS_OK);
+  TEST_CHECK_GE(SPIFFS_close(FS, fd), SPIFFS_OK);
+
+  SPIFFS_unmount(FS);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.name_index_count, (u32_t)file_cnt);
+
+  // every file is found through the table, reading less than a scan does
+  for (i = 0; i < file_cnt; i++) {
+    sprintf(name, "file%i", i);
+    TEST_CHECK_EQ(read_and_verify(name), 0);
+  }
+  u32_t indexed_bytes = 0, scanned_bytes = 0;
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    SPIFFS_unmount(FS);
+    TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+    TEST_CHECK_EQ(__fs.name_index_count, (u32_t)file_cnt);
+    if (pass == 1) {
+      __fs.name_index_count = 0;
+    }
+    clear_flash_ops_log();
+    for (i = file_cnt - 1; i >= 0; i--) {
+      spiffs_stat s;
+      sprintf(name, "file%i", i);
+      TEST_CHECK_EQ(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+      TEST_CHECK_EQ(s.size, (u32_t)(100 + i * 50));
+    }
+    if (pass == 0) {
+      indexed_bytes = get_flash_ops_log_read_bytes();
+    } else {
+      scanned_bytes = get_flash_ops_log_read_bytes();
+    }
+  }
+  __fs.name_index_count = (u32_t)file_cnt;
+  printf("  read bytes for %i lookups: %i with table, %i scanning\n", file_cnt, indexed_bytes, scanned_bytes);
+  TEST_CHECK_LT(indexed_bytes, scanned_bytes);
+
+  // a stale table still finds files changed or added since
+  TEST_CHECK_EQ(SPIFFS_remove(FS, "file5"), SPIFFS_OK);
+  res = test_create_and_write_file("file5", 333, 64);
+  TEST_CHECK(res >= 0);
+  res = test_create_and_write_file("newfile", 444, 64);
+  TEST_CHECK(res >= 0);
+  TEST_CHECK_EQ(read_and_verify("file5"), 0);
+  TEST_CHECK_EQ(read_and_verify("newfile"), 0);
+  TEST_CHECK_EQ(read_and_verify("file6"), 0);
+  spiffs_stat s;
+  TEST_CHECK_EQ(SPIFFS_stat(FS, "file5", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(s.size, 333);
+  TEST_CHECK_LT(SPIFFS_stat(FS, "nofile", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_NOT_FOUND);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
+#if SPIFFS_LU_SHADOW || SPIFFS_NAME_HASH || SPIFFS_FREE_COUNTS || SPIFFS_SUMMARY
+static int create_files(int file_cnt) {
+  int i;
+  char name[32];
+  for (i = 0; i < file_cnt; i++) {
+    sprintf(name, "file%i", i);
+    TEST_CHECK(test_create_and_write_file(name, 100 + i * 50, 64) >= 0);
+  }
+  return TEST_RES_OK;
+__fail_stop:
+  return TEST_RES_FAIL;
+}
+
+// Removes the even numbered of the files made by create_files, rewrites six
+// big files four times over, which takes garbage collection, then reads
+// everything back. With remount, the file system is unmounted and mounted
+// again after each round of rewrites. SPIFFS_check is left to the caller,
+// as it rebuilds the RAM tables the tests compare.
+static int churn_and_verify(int file_cnt, int remount) {
+  int i;
+  int run;
+  char name[32];
+  spiffs_stat s;
+  u32_t gc_runs = 0;
+
+  for (i = 0; i < file_cnt; i += 2) {
+    sprintf(name, "file%i", i);
+    TEST_CHECK_EQ(SPIFFS_remove(FS, name), SPIFFS_OK);
+  }
+  for (run = 0; run < 4; run++) {
+    for (i = 0; i < 6; i++) {
+      sprintf(name, "big%i", i);
+      if (run > 0) {
+        TEST_CHECK_EQ(SPIFFS_remove(FS, name), SPIFFS_OK);
+      }
+      TEST_CHECK(test_create_and_write_file(name, 250000 + run * 1000 + i, 1024) >= 0);
+    }
+#if SPIFFS_GC_STATS
+    gc_runs += __fs.stats_gc_runs;
+    __fs.stats_gc_runs = 0;
+#endif
+    if (remount) {
+      SPIFFS_unmount(FS);
+      TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+    }
+  }
+#if SPIFFS_GC_STATS
+  TEST_CHECK_GT(gc_runs, 0);
+#endif
+  for (i = 0; i < file_cnt; i++) {
+    sprintf(name, "file%i", i);
+    if (i & 1) {
+      TEST_CHECK_EQ(read_and_verify(name), 0);
+    } else {
+      TEST_CHECK_LT(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+      TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_NOT_FOUND);
+    }
+  }
+  for (i = 0; i < 6; i++) {
+    sprintf(name, "big%i", i);
+    TEST_CHECK_EQ(read_and_verify(name), 0);
+  }
+  return TEST_RES_OK;
+__fail_stop:
+  return TEST_RES_FAIL;
+}
+#endif
+
+#if SPIFFS_LU_SHADOW
+static int lu_shadow_matches_flash(spiffs *fs, u8_t *shadow) {
+  u32_t entries_sz = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) * sizeof(spiffs_obj_id);
+  u8_t *buf = malloc(entries_sz);
+  spiffs_block_ix bix;
+  int ok = 1;
+  for (bix = 0; ok && bix < fs->block_count; bix++) {
+    area_read(SPIFFS_BLOCK_TO_PADDR(fs, bix), buf, entries_sz);
+    ok = memcmp(buf, &shadow[bix * entries_sz], entries_sz) == 0;
+  }
+  free(buf);
+  return ok;
+}
+
+TEST(lu_shadow)
+{
+  int i;
+  char name[32];
+  int file_cnt = 40;
+  spiffs_stat s;
+
+  TEST_CHECK_EQ(create_files(file_cnt), TEST_RES_OK);
+
+  u32_t size = SPIFFS_lu_shadow_bytes(FS);
+  TEST_CHECK_EQ(size, __fs.block_count * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(FS) * sizeof(spiffs_obj_id));
+  u8_t *shadow = malloc(size);
+  TEST_CHECK_LT(SPIFFS_lu_shadow(FS, shadow, size - 1), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_LU_SHADOW_SIZE);
+  TEST_CHECK(__fs.lu_shadow == 0);
+
+  // stat'ing every file reads only object index headers with the shadow
+  u32_t shadow_bytes = 0, flash_bytes = 0;
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    TEST_CHECK_EQ(SPIFFS_lu_shadow(FS, pass == 0 ? shadow : 0, size), SPIFFS_OK);
+#if SPIFFS_NAME_INDEX
+    __fs.name_index_count = 0;
+#endif
+    clear_flash_ops_log();
+    for (i = file_cnt - 1; i >= 0; i--) {
+      sprintf(name, "file%i", i);
+      TEST_CHECK_EQ(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+      TEST_CHECK_EQ(s.size, (u32_t)(100 + i * 50));
+    }
+    TEST_CHECK_LT(SPIFFS_stat(FS, "nofile", &s), SPIFFS_OK);
+    if (pass == 0) {
+      shadow_bytes = get_flash_ops_log_read_bytes();
+    } else {
+      flash_bytes = get_flash_ops_log_read_bytes();
+    }
+  }
+  printf("  read bytes for %i lookups: %i with shadow, %i without\n", file_cnt + 1, shadow_bytes, flash_bytes);
+  TEST_CHECK_LT(shadow_bytes, flash_bytes);
+
+  // the shadow follows writes, removals and garbage collection
+  TEST_CHECK_EQ(SPIFFS_lu_shadow(FS, shadow, size), SPIFFS_OK);
+  TEST_CHECK_EQ(churn_and_verify(file_cnt, 0), TEST_RES_OK);
+  TEST_CHECK(lu_shadow_matches_flash(FS, shadow));
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+  TEST_CHECK(lu_shadow_matches_flash(FS, shadow));
+
+  SPIFFS_unmount(FS);
+  TEST_CHECK(__fs.lu_shadow == 0);
+  free(shadow);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
+#if SPIFFS_NAME_HASH
+TEST(name_hash)
+{
+  int res;
+  int i;
+  char name[32];
+  int file_cnt = 40;
+  spiffs_stat s;
+
+  TEST_CHECK_EQ(create_files(file_cnt), TEST_RES_OK);
+
+  u32_t size = SPIFFS_name_hash_bytes(FS, 60);
+  u8_t *tbl = malloc(size);
+  TEST_CHECK_LT(SPIFFS_name_hash(FS, tbl, SPIFFS_name_hash_bytes(FS, file_cnt / 2)), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_NAME_HASH_FULL);
+  TEST_CHECK(__fs.name_hash == 0);
+  TEST_CHECK_EQ(SPIFFS_name_hash(FS, tbl, size), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.name_hash_count, (u32_t)file_cnt);
+
+  // a missing name costs no reads at all
+  clear_flash_ops_log();
+  TEST_CHECK_LT(SPIFFS_stat(FS, "nofile", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_NOT_FOUND);
+  TEST_CHECK_EQ(get_flash_ops_log_read_bytes(), 0);
+
+  u32_t hashed_bytes = 0, scanned_bytes = 0;
+  int pass;
+  for (pass = 0; pass < 2; pass++) {
+    TEST_CHECK_EQ(SPIFFS_name_hash(FS, pass == 0 ? tbl : 0, size), SPIFFS_OK);
+#if SPIFFS_NAME_INDEX
+    __fs.name_index_count = 0;
+#endif
+    clear_flash_ops_log();
+    for (i = file_cnt - 1; i >= 0; i--) {
+      sprintf(name, "file%i", i);
+      TEST_CHECK_EQ(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+      TEST_CHECK_EQ(s.size, (u32_t)(100 + i * 50));
+      sprintf(name, "missing%i", i);
+      TEST_CHECK_LT(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+    }
+    if (pass == 0) {
+      hashed_bytes = get_flash_ops_log_read_bytes();
+    } else {
+      scanned_bytes = get_flash_ops_log_read_bytes();
+    }
+  }
+  printf("  read bytes for %i lookups: %i with table, %i scanning\n", file_cnt * 2, hashed_bytes, scanned_bytes);
+  TEST_CHECK_LT(hashed_bytes, scanned_bytes);
+
+  // the table follows removals, creations, garbage collection and renames
+  TEST_CHECK_EQ(SPIFFS_name_hash(FS, tbl, size), SPIFFS_OK);
+  TEST_CHECK_EQ(churn_and_verify(file_cnt, 0), TEST_RES_OK);
+  TEST_CHECK(__fs.name_hash != 0);
+  TEST_CHECK_EQ(__fs.name_hash_count, (u32_t)(file_cnt / 2 + 6));
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.name_hash_count, (u32_t)(file_cnt / 2 + 6));
+  TEST_CHECK_EQ(SPIFFS_rename(FS, "file3", "renamed3"), SPIFFS_OK);
+  TEST_CHECK_LT(SPIFFS_rename(FS, "file5", "renamed3"), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_CONFLICTING_NAME);
+  TEST_CHECK_EQ(SPIFFS_stat(FS, "renamed3", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(s.size, 250);
+  TEST_CHECK_LT(SPIFFS_stat(FS, "file3", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_NOT_FOUND);
+  TEST_CHECK_EQ(__fs.name_hash_count, (u32_t)(file_cnt / 2 + 6));
+
+  // a table that overflows is dropped, names are then found by scanning
+  for (i = 0; __fs.name_hash != 0; i++) {
+    TEST_CHECK_LT(i, 60);
+    sprintf(name, "more%i", i);
+    res = test_create_and_write_file(name, 10, 10);
+    TEST_CHECK(res >= 0);
+  }
+  TEST_CHECK_EQ(read_and_verify(name), 0);
+  TEST_CHECK_EQ(SPIFFS_stat(FS, "renamed3", &s), SPIFFS_OK);
+
+  SPIFFS_unmount(FS);
+  free(tbl);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
+#if SPIFFS_FREE_COUNTS
+TEST(free_counts)
+{
+  int pass;
+  int i;
+  spiffs_block_ix bix;
+  int entry;
+  spiffs_obj_id obj_id;
+  u32_t churn_bytes[2];
+  u32_t churn_reads[2];
+
+  u32_t size = SPIFFS_free_counts_bytes(FS);
+  TEST_CHECK_EQ(size, __fs.block_count * sizeof(spiffs_page_ix));
+  spiffs_page_ix *counts = malloc(size);
+  spiffs_page_ix *fresh = malloc(size);
+  TEST_CHECK_LT(SPIFFS_free_counts(FS, counts, size - 1), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_FREE_COUNTS_SIZE);
+
+  // the same rewrites of a nearly full file system, without and with counts
+  for (pass = 0; pass < 2; pass++) {
+    fs_reset();
+    TEST_CHECK_EQ(create_files(20), TEST_RES_OK);
+    if (pass == 1) {
+      TEST_CHECK_EQ(SPIFFS_free_counts(FS, counts, size), SPIFFS_OK);
+    }
+    clear_flash_ops_log();
+    u32_t cache_reads = __fs.cache_hits + __fs.cache_misses;
+    TEST_CHECK_EQ(churn_and_verify(20, 0), TEST_RES_OK);
+    churn_bytes[pass] = get_flash_ops_log_read_bytes();
+    churn_reads[pass] = __fs.cache_hits + __fs.cache_misses - cache_reads;
+  }
+  printf("  read bytes for rewrites: %i with counts, %i without\n", churn_bytes[1], churn_bytes[0]);
+  printf("  cached page reads for rewrites: %i with counts, %i without\n", churn_reads[1], churn_reads[0]);
+  TEST_CHECK_LT(churn_bytes[1], churn_bytes[0]);
+
+  // the counts kept up with allocations and erases
+  TEST_CHECK(__fs.free_counts == counts);
+  TEST_CHECK_EQ(SPIFFS_free_counts(FS, fresh, size), SPIFFS_OK);
+  TEST_CHECK_EQ(memcmp(counts, fresh, size), 0);
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+
+  // pages are found without reading flash, and are free. Nothing is written
+  // to them, so the counts are dropped with the unmount below
+  TEST_CHECK_EQ(SPIFFS_remove(FS, "big0"), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_remove(FS, "big1"), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_gc(FS, 4 * SPIFFS_CFG_LOG_BLOCK_SZ(FS)), SPIFFS_OK);
+  TEST_CHECK_GE(__fs.free_blocks, 4);
+  for (i = 0; i < 2 * (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(FS); i++) {
+    TEST_CHECK_GE(__fs.free_blocks, 2);
+    clear_flash_ops_log();
+    TEST_CHECK_EQ(spiffs_obj_lu_find_free(FS, __fs.free_cursor_block_ix, __fs.free_cursor_obj_lu_entry,
+        &bix, &entry), SPIFFS_OK);
+    TEST_CHECK_EQ(get_flash_ops_log_read_bytes(), 0);
+    area_read(SPIFFS_BLOCK_TO_PADDR(FS, bix) + entry * sizeof(spiffs_obj_id), (u8_t *)&obj_id, sizeof(obj_id));
+    TEST_CHECK_EQ(obj_id, SPIFFS_OBJ_ID_FREE);
+  }
+  // while without counts, finding one reads lookup pages
+  TEST_CHECK_EQ(SPIFFS_free_counts(FS, 0, 0), SPIFFS_OK);
+  clear_flash_ops_log();
+  TEST_CHECK_EQ(spiffs_obj_lu_find_free(FS, __fs.free_cursor_block_ix, __fs.free_cursor_obj_lu_entry,
+      &bix, &entry), SPIFFS_OK);
+  TEST_CHECK_GT(get_flash_ops_log_read_bytes(), 0);
+
+  SPIFFS_unmount(FS);
+  TEST_CHECK(__fs.free_counts == 0);
+  free(counts);
+  free(fresh);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
+#if SPIFFS_OBJ_ID_MAP && SPIFFS_NAME_HASH
+TEST(obj_id_map)
+{
+  int i;
+  int pass;
+  char name[32];
+  int file_cnt = 40;
+  u32_t creat_bytes[2];
+  spiffs_stat s;
+
+  TEST_CHECK_EQ(create_files(file_cnt), TEST_RES_OK);
+
+  u32_t size = SPIFFS_obj_id_map_bytes(FS);
+  TEST_CHECK_EQ(size, (SPIFFS_OBJ_ID_MAP_IDS(&__fs) + 7) / 8);
+  u8_t *map = malloc(size);
+  u8_t *fresh = malloc(size);
+  TEST_CHECK_LT(SPIFFS_obj_id_map(FS, map, size - 1), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_OBJ_ID_MAP_SIZE);
+  TEST_CHECK(__fs.obj_id_map == 0);
+
+  // the names are checked through the name hash table in both passes
+  u32_t hash_size = SPIFFS_name_hash_bytes(FS, file_cnt * 2);
+  u8_t *tbl = malloc(hash_size);
+  TEST_CHECK_EQ(SPIFFS_name_hash(FS, tbl, hash_size), SPIFFS_OK);
+
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      TEST_CHECK_EQ(SPIFFS_obj_id_map(FS, map, size), SPIFFS_OK);
+    }
+    clear_flash_ops_log();
+    for (i = 0; i < file_cnt / 2; i++) {
+      sprintf(name, "new%i", i);
+      TEST_CHECK_EQ(SPIFFS_creat(FS, name, 0), SPIFFS_OK);
+    }
+    creat_bytes[pass] = get_flash_ops_log_read_bytes();
+    for (i = 0; i < file_cnt / 2; i++) {
+      sprintf(name, "new%i", i);
+      TEST_CHECK_EQ(SPIFFS_stat(FS, name, &s), SPIFFS_OK);
+      TEST_CHECK_EQ(SPIFFS_remove(FS, name), SPIFFS_OK);
+    }
+  }
+  printf("  read bytes for %i creates: %i with map, %i scanning\n", file_cnt / 2, creat_bytes[1], creat_bytes[0]);
+  TEST_CHECK_LT(creat_bytes[1], creat_bytes[0]);
+
+  // names in use are still refused
+  TEST_CHECK_LT(SPIFFS_creat(FS, "file1", 0), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_CONFLICTING_NAME);
+
+  // the map follows creations, removals and garbage collection
+  TEST_CHECK_EQ(churn_and_verify(file_cnt, 0), TEST_RES_OK);
+  TEST_CHECK(__fs.obj_id_map == map);
+  TEST_CHECK_EQ(SPIFFS_obj_id_map(FS, fresh, size), SPIFFS_OK);
+  TEST_CHECK_EQ(memcmp(map, fresh, size), 0);
+
+  // a removed file's id is taken again
+  TEST_CHECK_EQ(SPIFFS_obj_id_map(FS, map, size), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_creat(FS, "once", 0), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_stat(FS, "once", &s), SPIFFS_OK);
+  spiffs_obj_id removed_id = s.obj_id;
+  TEST_CHECK_EQ(SPIFFS_remove(FS, "once"), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_creat(FS, "again", 0), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_stat(FS, "again", &s), SPIFFS_OK);
+  TEST_CHECK_EQ(s.obj_id, removed_id);
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+
+  // an id taken for a file that can't be created is free again
+  for (i = 0; ; i++) {
+    TEST_CHECK_LT(i, 100);
+    sprintf(name, "fill%i", i);
+    if (test_create_and_write_file(name, 50000, 1024) < 0) break;
+  }
+  TEST_CHECK_LT(SPIFFS_creat(FS, "nospace", 0), SPIFFS_OK);
+  TEST_CHECK_EQ(SPIFFS_errno(FS), SPIFFS_ERR_FULL);
+  TEST_CHECK(__fs.obj_id_map == map);
+  TEST_CHECK_EQ(SPIFFS_obj_id_map(FS, fresh, size), SPIFFS_OK);
+  TEST_CHECK_EQ(memcmp(map, fresh, size), 0);
+
+  SPIFFS_unmount(FS);
+  TEST_CHECK(__fs.obj_id_map == 0);
+  free(map);
+  free(fresh);
+  free(tbl);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
+#if SPIFFS_SUMMARY
+TEST(summary)
+{
+  u32_t free_blocks, p_allocated, p_deleted;
+  spiffs_obj_id max_erase_count;
+  u32_t summary_bytes, scan_bytes;
+
+  TEST_CHECK_EQ(create_files(20), TEST_RES_OK);
+
+  // a clean unmount leaves a summary, which the next mount takes instead of
+  // scanning; the counters include the summary page itself
+  SPIFFS_unmount(FS);
+  TEST_CHECK(__fs.summary_pix == 0);
+  free_blocks = __fs.free_blocks;
+  p_allocated = __fs.stats_p_allocated;
+  p_deleted = __fs.stats_p_deleted;
+  max_erase_count = __fs.max_erase_count;
+  clear_flash_ops_log();
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  summary_bytes = get_flash_ops_log_read_bytes();
+  TEST_CHECK(__fs.summary_pix != 0);
+  TEST_CHECK_EQ(__fs.summary_seq, 1);
+  TEST_CHECK_EQ(__fs.free_blocks, free_blocks);
+  TEST_CHECK_EQ(__fs.stats_p_allocated, p_allocated);
+  TEST_CHECK_EQ(__fs.stats_p_deleted, p_deleted);
+  TEST_CHECK_EQ(__fs.max_erase_count, max_erase_count);
+  TEST_CHECK_EQ(spiffs_obj_lu_scan(&__fs), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.free_blocks, free_blocks);
+  TEST_CHECK_EQ(__fs.stats_p_allocated, p_allocated);
+  TEST_CHECK_EQ(__fs.stats_p_deleted, p_deleted);
+  TEST_CHECK_EQ(__fs.max_erase_count, max_erase_count);
+
+  // reading leaves the summary, so unmounting again keeps it
+  TEST_CHECK_EQ(read_and_verify("file1"), 0);
+  SPIFFS_unmount(FS);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+  TEST_CHECK_EQ(__fs.summary_seq, 1);
+
+  // the first write deletes the summary, so a mount without unmounting, as
+  // after a power loss, scans
+  TEST_CHECK_EQ(SPIFFS_creat(FS, "extra", 0), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix == 0);
+  clear_flash_ops_log();
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  scan_bytes = get_flash_ops_log_read_bytes();
+  TEST_CHECK(__fs.summary_pix == 0);
+  printf("  read bytes for mount: %i with summary, %i scanning\n", summary_bytes, scan_bytes);
+  TEST_CHECK_LT(summary_bytes, scan_bytes);
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+
+  // garbage collection right after mounting from a summary, and the
+  // summaries written after it
+  SPIFFS_unmount(FS);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+  TEST_CHECK_EQ(__fs.summary_seq, 1);
+  TEST_CHECK_EQ(churn_and_verify(20, 1), TEST_RES_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+  TEST_CHECK_EQ(__fs.summary_seq, 5);
+  free_blocks = __fs.free_blocks;
+  p_allocated = __fs.stats_p_allocated;
+  p_deleted = __fs.stats_p_deleted;
+  max_erase_count = __fs.max_erase_count;
+  TEST_CHECK_EQ(spiffs_obj_lu_scan(&__fs), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.free_blocks, free_blocks);
+  TEST_CHECK_EQ(__fs.stats_p_allocated, p_allocated);
+  TEST_CHECK_EQ(__fs.stats_p_deleted, p_deleted);
+  TEST_CHECK_EQ(__fs.max_erase_count, max_erase_count);
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix == 0);
+
+  return TEST_RES_OK;
+}
+TEST_END
+
+// A writer built without summaries leaves the summary page in place. Here
+// that is played by forgetting the summary after mounting from it, and by
+// mounting again without unmounting, as such a writer leaves no summary.
+TEST(summary_stale)
+{
+  int i;
+  int run;
+  char name[32];
+  u32_t p_allocated, p_deleted;
+  spiffs_obj_id max_erase_count;
+
+  TEST_CHECK_EQ(create_files(20), TEST_RES_OK);
+  SPIFFS_unmount(FS);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+
+  // its first write takes the free page after the summary, which the next
+  // mount sees, so it scans and deletes the summary
+  __fs.summary_pix = 0;
+  TEST_CHECK(test_create_and_write_file("other", 1000, 100) >= 0);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix == 0);
+  TEST_CHECK_EQ(__fs.summary_counts, 0);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix == 0);
+  TEST_CHECK_EQ(read_and_verify("other"), 0);
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+
+  // pages it only deletes don't show at mount, so the counters are stale
+  // until garbage collection counts again before relying on them
+  SPIFFS_unmount(FS);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+  __fs.summary_pix = 0;
+  for (i = 0; i < 20; i += 2) {
+    sprintf(name, "file%i", i);
+    TEST_CHECK_EQ(SPIFFS_remove(FS, name), SPIFFS_OK);
+  }
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK(__fs.summary_pix != 0);
+  TEST_CHECK_EQ(__fs.summary_counts, 1);
+  p_deleted = __fs.stats_p_deleted;
+  TEST_CHECK_EQ(spiffs_obj_lu_scan(&__fs), SPIFFS_OK);
+  TEST_CHECK_GT(__fs.stats_p_deleted, p_deleted);
+  TEST_CHECK_EQ(fs_mount_specific(SPIFFS_PHYS_ADDR, SPIFFS_FLASH_SIZE, SECTOR_SIZE, LOG_BLOCK, LOG_PAGE), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.summary_counts, 1);
+  for (run = 0; run < 2; run++) {
+    for (i = 0; i < 6; i++) {
+      sprintf(name, "big%i", i);
+      if (run > 0) {
+        TEST_CHECK_EQ(SPIFFS_remove(FS, name), SPIFFS_OK);
+      }
+      TEST_CHECK(test_create_and_write_file(name, 250000 + run * 1000 + i, 1024) >= 0);
+    }
+  }
+#if SPIFFS_GC_STATS
+  TEST_CHECK_GT(__fs.stats_gc_runs, 0);
+#endif
+  TEST_CHECK_EQ(__fs.summary_counts, 0);
+  p_allocated = __fs.stats_p_allocated;
+  p_deleted = __fs.stats_p_deleted;
+  max_erase_count = __fs.max_erase_count;
+  TEST_CHECK_EQ(spiffs_obj_lu_scan(&__fs), SPIFFS_OK);
+  TEST_CHECK_EQ(__fs.stats_p_allocated, p_allocated);
+  TEST_CHECK_EQ(__fs.stats_p_deleted, p_deleted);
+  TEST_CHECK_EQ(__fs.max_erase_count, max_erase_count);
+  for (i = 1; i < 20; i += 2) {
+    sprintf(name, "file%i", i);
+    TEST_CHECK_EQ(read_and_verify(name), 0);
+  }
+  for (i = 0; i < 6; i++) {
+    sprintf(name, "big%i", i);
+    TEST_CHECK_EQ(read_and_verify(name), 0);
+  }
+  TEST_CHECK_EQ(SPIFFS_check(FS), SPIFFS_OK);
+
+  return TEST_RES_OK;
+}
+TEST_END
+#endif
+
 SUITE_TESTS(hydrogen_tests)
   ADD_TEST(info)
 #if SPIFFS_USE_MAGIC
@@ -2496,6 +3136,25 @@ SUITE_TESTS(hydrogen_tests)
   ADD_TEST(long_run_config_many_medium)
   ADD_TEST(long_run_config_many_small)
   ADD_TEST(long_run)
+#if SPIFFS_NAME_INDEX
+  ADD_TEST(name_index)
+#endif
+#if SPIFFS_LU_SHADOW
+  ADD_TEST(lu_shadow)
+#endif
+#if SPIFFS_NAME_HASH
+  ADD_TEST(name_hash)
+#endif
+#if SPIFFS_FREE_COUNTS
+  ADD_TEST(free_counts)
+#endif
+#if SPIFFS_OBJ_ID_MAP && SPIFFS_NAME_HASH
+  ADD_TEST(obj_id_map)
+#endif
+#if SPIFFS_SUMMARY
+  ADD_TEST(summary)
+  ADD_TEST(summary_stale)
+#endif
 #if SPIFFS_IX_MAP
   ADD_TEST(ix_map_basic)
   ADD_TEST(ix_map_remap)
@@ -0,0 +1,2136 @@
+//
+//  spiffs_image.cpp
+//  make_spiffs
+//
+
+#include "spiffs_image.h"
+extern "C" {
+#include "spiffs_nucleus.h"
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#endif
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#if !SPIFFS_HAL_CALLBACK_EXTRA
+#error "mkspiffs needs SPIFFS_HAL_CALLBACK_EXTRA to tell images apart in the HAL callbacks"
+#endif
+
+namespace mkspiffs {
+
+#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
+/**
+ * @brief SPIFFS metadata structure
+ */
+typedef struct {
+#ifdef CONFIG_SPIFFS_USE_MTIME
+    s32_t mtime;   /*!< file modification time */
+#endif
+#ifdef CONFIG_SPIFFS_USE_DIR
+    u8_t type;      /*!< file type */
+#endif
+} __attribute__((packed, aligned(1))) spiffs_meta_t;
+#endif
+
+// Source files are read and written into the image in chunks of this size
+static const size_t s_importChunkSize = 64 * 1024;
+
+// Unless addAllFiles is set, these files/directories will not be included into the image
+static const char* ignored_file_names[] = {
+    ".DS_Store",
+    ".git",
+    ".gitignore",
+    ".gitmodules"
+};
+
+// Reads one source file: from disk, from memory, or from the copy in a SourceCache
+struct Image::Source {
+    FILE* file;
+    SourceCache::Entry* shared;
+    const uint8_t* mem;
+    size_t size;
+    size_t pos;
+};
+
+// Pages of a directly laid out image are handed out strictly in order,
+// skipping the object lookup pages at the start of every block.
+struct Image::Layout {
+    spiffs fs;                  // only cfg and block_count are set, for the nucleus macros
+    spiffs_page_ix nextPix;
+    spiffs_block_ix usableBlocks;
+    spiffs_obj_id nextObjId;
+};
+
+uint64_t hashUpdate(uint64_t hash, const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+void printThroughput(std::ostream& out, const char* what, size_t bytes, double seconds)
+{
+    out << what << ": " << bytes << " bytes in " << seconds * 1000.0 << " ms";
+    if (seconds > 0) {
+        out << " (" << bytes / seconds / 1024.0 << " KB/s)";
+    }
+    out << std::endl;
+}
+
+#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
+static void spiffs_fill_meta(spiffs_meta_t *meta, u8_t type, time_t mtime)
+{
+#ifdef CONFIG_SPIFFS_USE_MTIME
+    // Keep the source file's modification time, so update() can tell
+    // unchanged files apart
+    meta->mtime = mtime;
+#endif //CONFIG_SPIFFS_USE_MTIME
+
+#ifdef CONFIG_SPIFFS_USE_DIR
+    // Add file type (directory or regular file) to the last byte of metadata
+    meta->type = type;
+#endif
+}
+#endif
+
+static bool spiffs_meta_is_dir(u8_t type, const u8_t* rawMeta)
+{
+#ifdef CONFIG_SPIFFS_USE_DIR
+    spiffs_meta_t meta;
+    memcpy(&meta, rawMeta, sizeof(meta));
+    return meta.type == SPIFFS_TYPE_DIR;
+#else
+    return type == SPIFFS_TYPE_DIR;
+#endif
+}
+
+static time_t spiffs_meta_mtime(const u8_t* rawMeta)
+{
+#ifdef CONFIG_SPIFFS_USE_MTIME
+    spiffs_meta_t meta;
+    memcpy(&meta, rawMeta, sizeof(meta));
+    return meta.mtime;
+#else
+    return 0;
+#endif
+}
+
+static bool dirExists(const char* path) {
+    DIR *d = opendir(path);
+
+    if (d) {
+        closedir(d);
+        return true;
+    }
+
+    return false;
+}
+
+bool hashSourceFile(const SourceFile& file, uint64_t* hash) {
+    *hash = HASH_INIT;
+    if (file.data) {
+        *hash = hashUpdate(*hash, file.data->empty() ? NULL : &(*file.data)[0], file.data->size());
+        return true;
+    }
+    FILE* src = fopen(file.path.c_str(), "rb");
+    if (!src) {
+        return false;
+    }
+    std::vector<uint8_t> chunk(s_importChunkSize);
+    size_t len;
+    while ((len = fread(&chunk[0], 1, chunk.size(), src)) > 0) {
+        *hash = hashUpdate(*hash, &chunk[0], len);
+    }
+    bool ok = !ferror(src);
+    fclose(src);
+    return ok;
+}
+
+bool readWearProfile(const std::string& path, size_t blockCount, std::vector<spiffs_obj_id>& counts, std::string& error) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        error = "failed to read " + path;
+        return false;
+    }
+
+    // A range "a-b", or a single number
+    auto parseRange = [](const std::string& word, unsigned long* lo, unsigned long* hi) {
+        char* end;
+        *lo = strtoul(word.c_str(), &end, 0);
+        *hi = *lo;
+        if (end != word.c_str() && *end == '-') {
+            const char* start = end + 1;
+            *hi = strtoul(start, &end, 0);
+            if (end == start) {
+                return false;
+            }
+        }
+        return end != word.c_str() && *end == 0 && *lo <= *hi;
+    };
+
+    std::vector<bool> given(blockCount, false);
+    counts.assign(blockCount, 0);
+    std::mt19937 rng(1);
+    bool haveDefault = false;
+    unsigned long defaultLo = 0, defaultHi = 0;
+    std::string line;
+    for (int lineNo = 1; std::getline(in, line); ++lineNo) {
+        std::istringstream words(line);
+        std::string blocksWord, countWord, rest;
+        if (!(words >> blocksWord) || blocksWord[0] == '#') {
+            continue;
+        }
+        unsigned long first, last, lo, hi;
+        bool all = blocksWord == "*";
+        if (!(words >> countWord) || (words >> rest) || !parseRange(countWord, &lo, &hi) ||
+            (!all && !parseRange(blocksWord, &first, &last))) {
+            error = path + ":" + std::to_string(lineNo) + ": expected <block>[-<block>]|* <count>[-<count>]";
+            return false;
+        }
+        if (hi >= SPIFFS_OBJ_ID_IX_FLAG) {
+            error = path + ":" + std::to_string(lineNo) + ": erase counts must be below 32768";
+            return false;
+        }
+        if (all) {
+            haveDefault = true;
+            defaultLo = lo;
+            defaultHi = hi;
+            continue;
+        }
+        if (first >= blockCount) {
+            error = path + ":" + std::to_string(lineNo) + ": block " + std::to_string(first) +
+                    " is past the last block, " + std::to_string(blockCount - 1);
+            return false;
+        }
+        for (unsigned long bix = first; bix <= last && bix < blockCount; ++bix) {
+            counts[bix] = (spiffs_obj_id)(lo + rng() % (hi - lo + 1));
+            given[bix] = true;
+        }
+    }
+    for (size_t bix = 0; haveDefault && bix < blockCount; ++bix) {
+        if (!given[bix]) {
+            counts[bix] = (spiffs_obj_id)(defaultLo + rng() % (defaultHi - defaultLo + 1));
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Create a directory unless it exists.
+ * @return True if the directory exists now.
+ */
+static bool dirCreate(const char* path) {
+    if (dirExists(path)) {
+        return true;
+    }
+
+    // platform stuff...
+#if defined(_WIN32)
+    return _mkdir(path) == 0;
+#else
+    return mkdir(path, S_IRWXU | S_IXGRP | S_IRGRP | S_IROTH | S_IXOTH) == 0;
+#endif
+}
+
+static bool collectDir(const std::string& dirName, const std::string& subPath, std::vector<SourceFile>& files,
+                       bool addAllFiles, std::ostream* log) {
+    DIR *dir;
+    struct dirent *ent;
+    std::string dirPath = dirName + subPath;
+
+    // Open directory
+    if ((dir = opendir (dirPath.c_str())) == NULL) {
+        return false;
+    }
+
+    // Read files from directory.
+    while ((ent = readdir (dir)) != NULL) {
+
+        // Ignore dir itself.
+        if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0)) {
+            continue;
+        }
+
+        if (!addAllFiles) {
+            bool skip = false;
+            size_t ignored_file_names_count = sizeof(ignored_file_names) / sizeof(ignored_file_names[0]);
+            for (size_t i = 0; i < ignored_file_names_count; ++i) {
+                if (strcmp(ent->d_name, ignored_file_names[i]) == 0) {
+                    if (log) *log << "skipping " << ent->d_name << std::endl;
+                    skip = true;
+                    break;
+                }
+            }
+            if (skip) {
+                continue;
+            }
+        }
+
+        std::string fullpath = dirPath;
+        fullpath += ent->d_name;
+        struct stat path_stat;
+        stat (fullpath.c_str(), &path_stat);
+
+        SourceFile file;
+        file.name = subPath;
+        file.name += ent->d_name;
+        file.path = fullpath;
+        file.isDir = S_ISDIR(path_stat.st_mode);
+        file.size = file.isDir ? 0 : path_stat.st_size;
+        file.mtime = path_stat.st_mtime;
+
+        if (file.isDir) {
+            files.push_back(file);
+            if (!collectDir(dirName, file.name + "/", files, addAllFiles, log) && log) {
+                *log << "warning: can't read " << fullpath << std::endl;
+            }
+        } else if (S_ISREG(path_stat.st_mode)) {
+            files.push_back(file);
+        } else if (log) {
+            *log << "skipping " << ent->d_name << std::endl;
+        }
+    }
+    closedir (dir);
+
+    return true;
+}
+
+bool collectFiles(const std::string& dirName, std::vector<SourceFile>& files, bool addAllFiles, std::ostream* log) {
+    return collectDir(dirName, "/", files, addAllFiles, log);
+}
+
+// Tar streams
+//
+// An archive is a sequence of 512 byte headers, each followed by the
+// entry data padded to a whole number of blocks, and ends with two zero
+// blocks. A pax 'x' entry or a GNU 'L' entry carries the long name, size
+// or modification time of the entry that follows it.
+
+static const size_t s_tarBlockSize = 512;
+
+static bool tarReadBlock(FILE* in, uint8_t* block) {
+    return fread(block, 1, s_tarBlockSize, in) == s_tarBlockSize;
+}
+
+// Numeric header field: octal text, or big endian base-256 if the top bit is set
+static uint64_t tarNumber(const uint8_t* field, size_t len) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        ++i;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+static std::string tarString(const uint8_t* field, size_t len) {
+    const uint8_t* end = (const uint8_t*)memchr(field, 0, len);
+    return std::string((const char*)field, end ? end - field : len);
+}
+
+static bool tarReadData(FILE* in, uint64_t size, std::vector<uint8_t>* data) {
+    if (data) {
+        data->resize(size);
+        if (size > 0 && fread(&(*data)[0], 1, size, in) != size) {
+            return false;
+        }
+    } else {
+        uint8_t block[s_tarBlockSize];
+        for (uint64_t left = size; left > 0; left -= std::min(left, (uint64_t)s_tarBlockSize)) {
+            if (fread(block, 1, std::min(left, (uint64_t)s_tarBlockSize), in) == 0) {
+                return false;
+            }
+        }
+    }
+    uint8_t pad[s_tarBlockSize];
+    size_t padLen = (s_tarBlockSize - size % s_tarBlockSize) % s_tarBlockSize;
+    return fread(pad, 1, padLen, in) == padLen;
+}
+
+// Records of a pax extended header: "<length> <key>=<value>\n"
+static void tarParsePax(const std::vector<uint8_t>& data, std::map<std::string, std::string>& records) {
+    std::string text(data.begin(), data.end());
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t space = text.find(' ', pos);
+        if (space == std::string::npos) {
+            return;
+        }
+        size_t len = strtoul(text.c_str() + pos, NULL, 10);
+        if (len <= space - pos || pos + len > text.size()) {
+            return;
+        }
+        std::string record = text.substr(space + 1, pos + len - space - 1);
+        if (!record.empty() && record[record.size() - 1] == '\n') {
+            record.erase(record.size() - 1);
+        }
+        size_t eq = record.find('=');
+        if (eq != std::string::npos) {
+            records[record.substr(0, eq)] = record.substr(eq + 1);
+        }
+        pos += len;
+    }
+}
+
+// Image path of an archive member: "./www/index.html" becomes "/www/index.html".
+// Empty for the archive root and for paths leaving it.
+static std::string tarImagePath(const std::string& path) {
+    std::string result;
+    size_t pos = 0;
+    while (pos <= path.size()) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string part = path.substr(pos, end - pos);
+        if (part == "..") {
+            return "";
+        }
+        if (!part.empty() && part != ".") {
+            result += "/" + part;
+        }
+        pos = end + 1;
+    }
+    return result;
+}
+
+static bool tarIgnored(const std::string& name) {
+    size_t ignored_file_names_count = sizeof(ignored_file_names) / sizeof(ignored_file_names[0]);
+    for (size_t pos = 1; pos < name.size(); ) {
+        size_t end = name.find('/', pos);
+        if (end == std::string::npos) {
+            end = name.size();
+        }
+        for (size_t i = 0; i < ignored_file_names_count; ++i) {
+            if (name.compare(pos, end - pos, ignored_file_names[i]) == 0) {
+                return true;
+            }
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+bool readTar(FILE* in, std::vector<SourceFile>& files, bool addAllFiles, std::ostream* log, std::string& error) {
+    std::map<std::string, size_t> entries;  // image path -> index in files
+    std::map<std::string, std::string> pax;
+    std::string longName;
+    uint8_t block[s_tarBlockSize];
+
+    while (true) {
+        if (!tarReadBlock(in, block)) {
+            error = "unexpected end of tar stream";
+            return false;
+        }
+        unsigned sum = 0;
+        bool zero = true;
+        for (size_t i = 0; i < s_tarBlockSize; ++i) {
+            sum += (i >= 148 && i < 156) ? ' ' : block[i];
+            zero = zero && block[i] == 0;
+        }
+        if (zero) {
+            return true;
+        }
+        if (sum != tarNumber(block + 148, 8)) {
+            error = "bad tar header checksum";
+            return false;
+        }
+
+        char type = block[156];
+        uint64_t size = tarNumber(block + 124, 12);
+        std::map<std::string, std::string>::const_iterator it = pax.find("size");
+        if (it != pax.end()) {
+            size = strtoull(it->second.c_str(), NULL, 10);
+        }
+
+        if (type == 'x' || type == 'g' || type == 'L') {
+            std::vector<uint8_t> data;
+            if (!tarReadData(in, size, &data)) {
+                error = "unexpected end of tar stream";
+                return false;
+            }
+            if (type == 'x') {
+                tarParsePax(data, pax);
+            } else if (type == 'L') {
+                longName.assign(data.begin(), std::find(data.begin(), data.end(), 0));
+            }
+            continue;
+        }
+
+        std::string path = tarString(block, 100);
+        if (memcmp(block + 257, "ustar\0", 6) == 0 && block[345]) {
+            path = tarString(block + 345, 155) + "/" + path;
+        }
+        if (!longName.empty()) {
+            path = longName;
+        }
+        if ((it = pax.find("path")) != pax.end()) {
+            path = it->second;
+        }
+        time_t mtime = (time_t)tarNumber(block + 136, 12);
+        if ((it = pax.find("mtime")) != pax.end()) {
+            mtime = (time_t)strtoll(it->second.c_str(), NULL, 10);
+        }
+        pax.clear();
+        longName.clear();
+
+        bool isDir = type == '5';
+        bool isFile = type == '0' || type == '\0' || type == '7';
+        std::string name = tarImagePath(path);
+        std::vector<uint8_t>* data = NULL;
+        std::shared_ptr<std::vector<uint8_t> > contents;
+        if (name.empty() || (!isDir && !isFile) || (!addAllFiles && tarIgnored(name))) {
+            if (log && !(name.empty() && isDir)) {
+                *log << "skipping " << path << std::endl;
+            }
+        } else if (isFile) {
+            contents = std::make_shared<std::vector<uint8_t> >();
+            data = contents.get();
+        }
+        if (!tarReadData(in, isDir ? 0 : size, data)) {
+            error = "unexpected end of tar stream";
+            return false;
+        }
+        if (!data && !(isDir && !name.empty() && (addAllFiles || !tarIgnored(name)))) {
+            continue;
+        }
+
+        // Parent directories first
+        for (size_t slash = name.find('/', 1); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+            std::string dirName = name.substr(0, slash);
+            if (entries.find(dirName) == entries.end()) {
+                SourceFile dir;
+                dir.name = dirName;
+                dir.isDir = true;
+                dir.mtime = mtime;
+                entries[dirName] = files.size();
+                files.push_back(dir);
+            }
+        }
+
+        SourceFile file;
+        file.name = name;
+        file.isDir = isDir;
+        file.size = data ? data->size() : 0;
+        file.mtime = mtime;
+        file.data = contents;
+        std::map<std::string, size_t>::iterator entry = entries.find(name);
+        if (entry == entries.end()) {
+            entries[name] = files.size();
+            files.push_back(file);
+        } else if (files[entry->second].isDir == isDir) {
+            // A later member of the same name replaces the earlier one, as on extraction
+            files[entry->second] = file;
+        } else if (log) {
+            *log << "skipping " << path << std::endl;
+        }
+    }
+}
+
+bool readAccessOrder(const std::string& path, const std::vector<SourceFile>& files, std::vector<std::string>& names) {
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+
+    std::map<std::string, bool> mentioned;
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].isDir) {
+            mentioned[files[i].name] = false;
+        }
+    }
+
+    static const char* separators = " \t\r\"'(),;=<>[]{}";
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start != std::string::npos && line[start] == '#') {
+            continue;
+        }
+        while ((start = line.find_first_not_of(separators, start)) != std::string::npos) {
+            size_t end = line.find_first_of(separators, start);
+            std::string word = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            start = end;
+            // the longest suffix starting at a '/' that is a file of the tree
+            for (size_t slash = word.find('/'); slash != std::string::npos; slash = word.find('/', slash + 1)) {
+                std::map<std::string, bool>::iterator it = mentioned.find(word.substr(slash));
+                if (it != mentioned.end()) {
+                    if (!it->second) {
+                        it->second = true;
+                        names.push_back(it->first);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void placeFirst(std::vector<SourceFile>& files, const std::vector<std::string>& names) {
+    std::map<std::string, size_t> index;
+    for (size_t i = 0; i < files.size(); ++i) {
+        index[files[i].name] = i;
+    }
+
+    std::vector<bool> placed(files.size(), false);
+    std::vector<SourceFile> ordered;
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::map<std::string, size_t>::iterator file = index.find(names[i]);
+        if (file == index.end() || placed[file->second]) {
+            continue;
+        }
+        for (size_t slash = names[i].find('/', 1); slash != std::string::npos; slash = names[i].find('/', slash + 1)) {
+            std::map<std::string, size_t>::iterator dir = index.find(names[i].substr(0, slash));
+            if (dir != index.end() && !placed[dir->second]) {
+                placed[dir->second] = true;
+                ordered.push_back(files[dir->second]);
+            }
+        }
+        placed[file->second] = true;
+        ordered.push_back(files[file->second]);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!placed[i]) {
+            ordered.push_back(files[i]);
+        }
+    }
+    files.swap(ordered);
+}
+
+void SourceCache::share(const std::string& path, int users) {
+    std::shared_ptr<Entry> entry(new Entry);
+    entry->ok = false;
+    entry->users = users;
+    m_entries[path] = entry;
+}
+
+Image::Image(size_t size, size_t pageSize, size_t blockSize)
+    : m_size(size), m_pageSize(pageSize), m_blockSize(blockSize),
+      m_flashmem(NULL), m_flashmemMapped(false), m_flashmemBorrowed(false), m_flashmemFd(-1), m_writeBack(false),
+      m_directLayout(false), m_compareHash(false), m_nameIndex(false), m_sourceCache(NULL),
+      m_log(NULL), m_err(NULL), m_debugLevel(0), m_checkIssues(0),
+      m_importedBytes(0), m_importSeconds(0), m_readOps(0), m_readBytes(0) {
+    memset(&m_fs, 0, sizeof(m_fs));
+    m_fs.user_data = this;
+}
+
+Image::~Image() {
+    close();
+}
+
+void Image::setLog(std::ostream* log, std::ostream* err, int debugLevel) {
+    m_log = log;
+    m_err = err;
+    m_debugLevel = debugLevel;
+}
+
+bool Image::fail(const std::string& message) {
+    m_error = message;
+    if (m_err) {
+        *m_err << "error: " << message << std::endl;
+    }
+    return false;
+}
+
+bool Image::failSpiffs(const char* call) {
+    std::ostringstream message;
+    message << call << " error(" << m_fs.err_code << ")";
+    if (m_fs.err_code == SPIFFS_ERR_FULL) {
+        message << ": File system is full.";
+    }
+    SPIFFS_clearerr(&m_fs);
+    return fail(message.str());
+}
+
+// HAL
+
+s32_t Image::halRead(spiffs* fs, u32_t addr, u32_t size, u8_t* dst) {
+    Image* img = (Image*)fs->user_data;
+    img->m_readOps++;
+    img->m_readBytes += size;
+    memcpy(dst, img->m_flashmem + addr, size);
+    return SPIFFS_OK;
+}
+
+s32_t Image::halWrite(spiffs* fs, u32_t addr, u32_t size, u8_t* src) {
+    memcpy(((Image*)fs->user_data)->m_flashmem + addr, src, size);
+    return SPIFFS_OK;
+}
+
+s32_t Image::halErase(spiffs* fs, u32_t addr, u32_t size) {
+    memset(((Image*)fs->user_data)->m_flashmem + addr, 0xff, size);
+    return SPIFFS_OK;
+}
+
+// Flash buffer
+
+bool Image::create() {
+    close();
+    m_flashmem = (uint8_t*)malloc(m_size);
+    if (!m_flashmem) {
+        return fail("out of memory");
+    }
+    memset(m_flashmem, 0xff, m_size);
+    return true;
+}
+
+bool Image::load(const uint8_t* data, size_t size) {
+    if (!create()) {
+        return false;
+    }
+    memcpy(m_flashmem, data, std::min(size, m_size));
+    return true;
+}
+
+bool Image::open(const std::string& path, ImageMode mode) {
+    close();
+    bool create = (mode == IMAGE_CREATE);
+    bool shared = (mode != IMAGE_READ);
+    m_path = path;
+    m_writeBack = shared;
+
+#if !defined(_WIN32)
+    // Files with other hard links, such as cache entries, must keep their
+    // contents: a created image is a new file rather than a truncated one,
+    // and an updated one is buffered and saved as a new file
+    struct stat st;
+    bool linked = false;
+    if (create) {
+        ::unlink(path.c_str());
+    } else if (shared) {
+        linked = ::stat(path.c_str(), &st) == 0 && st.st_nlink > 1;
+    }
+    m_flashmemFd = create ? ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666)
+                          : ::open(path.c_str(), shared && !linked ? O_RDWR : O_RDONLY);
+    if (m_flashmemFd < 0) {
+        return fail("failed to open image file");
+    }
+
+    if (create && ftruncate(m_flashmemFd, m_size) != 0) {
+        ::close(m_flashmemFd);
+        m_flashmemFd = -1;
+        return fail("failed to resize image file");
+    }
+    if (!linked && fstat(m_flashmemFd, &st) == 0 && (size_t)st.st_size >= m_size) {
+        void* mem = mmap(NULL, m_size, PROT_READ | PROT_WRITE,
+                         shared ? MAP_SHARED : MAP_PRIVATE, m_flashmemFd, 0);
+        if (mem != MAP_FAILED) {
+            m_flashmem = (uint8_t*)mem;
+            m_flashmemMapped = true;
+            if (create) {
+                // Bytes past the last whole block are never erased by spiffs
+                size_t tail = m_size - m_size % m_blockSize;
+                memset(m_flashmem + tail, 0xff, m_size - tail);
+            }
+            return true;
+        }
+    }
+#endif
+
+    m_flashmem = (uint8_t*)malloc(m_size);
+    if (!m_flashmem) {
+        return fail("out of memory");
+    }
+    memset(m_flashmem, 0xff, m_size);
+    if (!create) {
+        FILE* fdsrc = fopen(path.c_str(), "rb");
+        if (!fdsrc) {
+            return fail("failed to open image file");
+        }
+        if (fread(m_flashmem, 1, m_size, fdsrc) == 0 && ferror(fdsrc)) {
+            fclose(fdsrc);
+            return fail("failed to read from image file");
+        }
+        fclose(fdsrc);
+    }
+    return true;
+}
+
+bool Image::save(const std::string& path) {
+    remove(path.c_str());
+    FILE* fdres = fopen(path.c_str(), "wb");
+    bool ok = fdres && fwrite(m_flashmem, 1, m_size, fdres) == m_size;
+    if (fdres) {
+        fclose(fdres);
+    }
+    return ok || fail("failed to write image file");
+}
+
+bool Image::close() {
+    bool ok = true;
+    unmount();
+    if (!m_flashmem) {
+        return ok;
+    }
+    if (m_flashmemBorrowed) {
+        // the owner releases it
+    } else
+#if !defined(_WIN32)
+    if (m_flashmemMapped) {
+        munmap(m_flashmem, m_size);
+    } else
+#endif
+    {
+        if (m_writeBack && !m_path.empty()) {
+            ok = save(m_path);
+        }
+        free(m_flashmem);
+    }
+#if !defined(_WIN32)
+    if (m_flashmemFd >= 0) {
+        ::close(m_flashmemFd);
+    }
+#endif
+    m_flashmem = NULL;
+    m_flashmemMapped = false;
+    m_flashmemBorrowed = false;
+    m_flashmemFd = -1;
+    m_path.clear();
+    m_writeBack = false;
+    return ok;
+}
+
+// Mounting
+
+s32_t Image::tryMount() {
+    spiffs_config cfg = {0};
+
+    cfg.phys_addr = 0x0000;
+    cfg.phys_size = (u32_t) m_size;
+
+    cfg.phys_erase_block = m_blockSize;
+    cfg.log_block_size = m_blockSize;
+    cfg.log_page_size = m_pageSize;
+
+    cfg.hal_read_f = halRead;
+    cfg.hal_write_f = halWrite;
+    cfg.hal_erase_f = halErase;
+
+    const int maxOpenFiles = 4;
+    m_workBuf.resize(m_pageSize * 2);
+    m_fds.resize(sizeof(spiffs_fd) * maxOpenFiles);
+    m_cache.resize(sizeof(spiffs_cache) + maxOpenFiles * (sizeof(spiffs_cache_page) + cfg.log_page_size));
+
+    return SPIFFS_mount(&m_fs, &cfg,
+        &m_workBuf[0],
+        &m_fds[0], m_fds.size(),
+        &m_cache[0], m_cache.size(),
+        NULL);
+}
+
+bool Image::mount() {
+    if (!m_flashmem) {
+        return fail("no image open");
+    }
+    if (SPIFFS_mounted(&m_fs)) {
+        return true;
+    }
+    return tryMount() == SPIFFS_OK || fail("failed to mount image");
+}
+
+bool Image::format() {
+    if (!m_flashmem) {
+        return fail("no image open");
+    }
+    if (!SPIFFS_mounted(&m_fs)) {
+        // sets up the configuration SPIFFS_format needs
+        tryMount();
+    }
+    SPIFFS_unmount(&m_fs);
+    if (SPIFFS_format(&m_fs) != SPIFFS_OK || tryMount() != SPIFFS_OK) {
+        return fail("failed to format image");
+    }
+    return true;
+}
+
+void Image::unmount() {
+    if (SPIFFS_mounted(&m_fs)) {
+        SPIFFS_unmount(&m_fs);
+    }
+}
+
+// Adding files
+
+void Image::updateMeta(spiffs_file fd, u8_t type, time_t mtime) {
+#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
+    spiffs_meta_t meta;
+    spiffs_fill_meta(&meta, type, mtime);
+    int ret = SPIFFS_fupdate_meta(&m_fs, fd, (uint8_t *)&meta);
+    if (ret != SPIFFS_OK && m_err) {
+        *m_err << "error: Failed to update metadata: " << ret << std::endl;
+    }
+#endif
+}
+
+bool Image::sourceOpen(const SourceFile& file, Source& src) {
+    src.file = NULL;
+    src.shared = NULL;
+    src.mem = NULL;
+    src.size = 0;
+    src.pos = 0;
+
+    if (file.data) {
+        src.mem = file.data->empty() ? NULL : &(*file.data)[0];
+        src.size = file.data->size();
+        return true;
+    }
+
+    if (m_sourceCache) {
+        std::map<std::string, std::shared_ptr<SourceCache::Entry> >::const_iterator it =
+            m_sourceCache->m_entries.find(file.path);
+        if (it != m_sourceCache->m_entries.end()) {
+            SourceCache::Entry* shared = it->second.get();
+            const std::string& path = file.path;
+            std::call_once(shared->loaded, [shared, &path]() {
+                FILE* f = fopen(path.c_str(), "rb");
+                if (!f) {
+                    return;
+                }
+                fseek(f, 0, SEEK_END);
+                shared->data.resize(ftell(f));
+                fseek(f, 0, SEEK_SET);
+                shared->ok = shared->data.empty() || fread(&shared->data[0], 1, shared->data.size(), f) == shared->data.size();
+                fclose(f);
+            });
+            src.shared = shared;
+            if (!shared->ok) {
+                return fail("failed to read " + path);
+            }
+            src.mem = shared->data.empty() ? NULL : &shared->data[0];
+            src.size = shared->data.size();
+            return true;
+        }
+    }
+
+    src.file = fopen(file.path.c_str(), "rb");
+    if (!src.file) {
+        return fail("failed to open " + file.path + " for reading");
+    }
+    setvbuf(src.file, NULL, _IOFBF, s_importChunkSize);
+    fseek(src.file, 0, SEEK_END);
+    src.size = ftell(src.file);
+    fseek(src.file, 0, SEEK_SET);
+    return true;
+}
+
+size_t Image::sourceRead(Source& src, uint8_t* dst, size_t len) {
+    if (src.file) {
+        return fread(dst, 1, len, src.file);
+    }
+    len = std::min(len, src.size - src.pos);
+    if (len > 0) {
+        memcpy(dst, src.mem + src.pos, len);
+        src.pos += len;
+    }
+    return len;
+}
+
+void Image::sourceClose(Source& src) {
+    if (src.file) {
+        fclose(src.file);
+    }
+    if (src.shared && --src.shared->users == 0) {
+        std::vector<uint8_t>().swap(src.shared->data);
+    }
+}
+
+bool Image::addFile(const SourceFile& file) {
+    Source src;
+    bool ok = sourceOpen(file, src) && writeObject(file.name, file.mtime, src);
+    sourceClose(src);
+    return ok;
+}
+
+bool Image::writeFile(const std::string& name, const uint8_t* data, size_t size, time_t mtime) {
+    Source src = {NULL, NULL, data, size, 0};
+    return mount() && writeObject(name, mtime, src);
+}
+
+bool Image::writeObject(const std::string& name, time_t mtime, Source& src) {
+    spiffs_file dst = SPIFFS_open(&m_fs, name.c_str(), SPIFFS_CREAT | SPIFFS_TRUNC | SPIFFS_RDWR, 0);
+    if (dst < 0) {
+        return failSpiffs("SPIFFS_open");
+    }
+    updateMeta(dst, SPIFFS_TYPE_FILE, mtime);
+
+    size_t size = src.size;
+    if (m_log && m_debugLevel > 0) {
+        *m_log << "file size: " << size << std::endl;
+    }
+
+    // Stream the file in large chunks, so the engine gets page-sized
+    // or larger writes instead of one locked call per byte.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<uint8_t> chunk(std::min(size, s_importChunkSize));
+    size_t left = size;
+    while (left > 0){
+        size_t len = std::min(left, chunk.size());
+        if (len != sourceRead(src, &chunk[0], len)) {
+            SPIFFS_close(&m_fs, dst);
+            return fail("failed to read source of " + name);
+        }
+        if (SPIFFS_write(&m_fs, dst, &chunk[0], len) < 0) {
+            if (m_log && m_debugLevel > 0) {
+                *m_log << "data left: " << left << std::endl;
+            }
+            failSpiffs("SPIFFS_write");
+            SPIFFS_close(&m_fs, dst);
+            return false;
+        }
+        left -= len;
+    }
+
+    if (SPIFFS_close(&m_fs, dst) < 0) {
+        return failSpiffs("SPIFFS_close");
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    m_importedBytes += size;
+    m_importSeconds += seconds;
+    if (m_log && m_debugLevel > 0) {
+        printThroughput(*m_log, "file written", size, seconds);
+    }
+    return true;
+}
+
+bool Image::addDir(const SourceFile& file) {
+#ifdef CONFIG_SPIFFS_USE_DIR
+    spiffs_file dst = SPIFFS_open(&m_fs, file.name.c_str(), SPIFFS_CREAT | SPIFFS_WRONLY, 0);
+    if (dst < 0) {
+        return failSpiffs("SPIFFS_open");
+    }
+    updateMeta(dst, SPIFFS_TYPE_DIR, file.mtime);
+    if (SPIFFS_close(&m_fs, dst) < 0) {
+        return failSpiffs("SPIFFS_close");
+    }
+#endif
+    return true;
+}
+
+bool Image::pack(const std::vector<SourceFile>& files) {
+    if (m_directLayout) {
+        if (!m_flashmem) {
+            return fail("no image open");
+        }
+        unmount();
+        if (!layoutFiles(files) || !check()) {
+            return false;
+        }
+#if SPIFFS_NAME_INDEX
+        if (m_nameIndex && !writeNameIndex()) {
+            return false;
+        }
+#endif
+        unmount();
+        return stampEraseCounts();
+    }
+
+    if (!format()) {
+        return false;
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        const SourceFile& file = files[i];
+
+        if (file.isDir) {
+#ifdef CONFIG_SPIFFS_USE_DIR
+            if (m_log) *m_log << file.name << " [D]" << std::endl;
+            if (!addDir(file)) {
+                return false;
+            }
+#endif
+            continue;
+        }
+
+        if (m_log) *m_log << file.name << std::endl;
+        if (!addFile(file)) {
+            return false;
+        }
+    }
+#if SPIFFS_NAME_INDEX
+    if (m_nameIndex && !writeNameIndex()) {
+        return false;
+    }
+#endif
+    unmount();
+    return stampEraseCounts();
+}
+
+/**
+ * @brief Overwrite the erase count of each block with the one set by
+ *        setEraseCounts(); the image must not be mounted.
+ */
+bool Image::stampEraseCounts() {
+    spiffs fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.cfg.log_page_size = m_pageSize;
+    fs.cfg.log_block_size = m_blockSize;
+    fs.cfg.phys_addr = 0;
+    size_t blocks = std::min(m_eraseCounts.size(), m_size / m_blockSize);
+    for (spiffs_block_ix bix = 0; bix < blocks; ++bix) {
+        spiffs_obj_id eraseCount = m_eraseCounts[bix];
+        if (eraseCount >= SPIFFS_OBJ_ID_IX_FLAG) {
+            return fail("erase counts must be below 32768");
+        }
+        memcpy(m_flashmem + SPIFFS_ERASE_COUNT_PADDR(&fs, bix), &eraseCount, sizeof(eraseCount));
+    }
+    return true;
+}
+
+// Direct layout
+
+bool Image::layoutAllocPage(Layout& layout, spiffs_obj_id luId, spiffs_page_ix* pix) {
+    spiffs* fs = &layout.fs;
+    if (SPIFFS_IS_LOOKUP_PAGE(fs, layout.nextPix)) {
+        layout.nextPix += SPIFFS_OBJ_LOOKUP_PAGES(fs);
+    }
+    spiffs_block_ix bix = SPIFFS_BLOCK_FOR_PAGE(fs, layout.nextPix);
+    if (bix >= layout.usableBlocks) {
+        return fail("File system is full.");
+    }
+    *pix = layout.nextPix++;
+
+    // occupy page in object lookup
+    memcpy(m_flashmem + SPIFFS_BLOCK_TO_PADDR(fs, bix) + SPIFFS_OBJ_LOOKUP_ENTRY_FOR_PAGE(fs, *pix) * sizeof(spiffs_obj_id),
+           &luId, sizeof(spiffs_obj_id));
+    return true;
+}
+
+/**
+ * @brief Write one object (file or directory) straight into the image.
+ * @param layout Layout state.
+ * @param file Source entry; its contents are read sequentially, page by page.
+ * @return True or false.
+ *
+ * Produces the same on-flash structures spiffs_object_create(),
+ * spiffs_object_append() and spiffs_object_update_index_hdr() would, but
+ * without deleted pages: the index header is written once, when the data
+ * page indices are known.
+ */
+bool Image::layoutFile(Layout& layout, const SourceFile& file) {
+    spiffs* fs = &layout.fs;
+
+    if (file.name.size() > SPIFFS_OBJ_NAME_LEN - 1) {
+        return fail("name too long: " + file.name);
+    }
+
+    Source src = {NULL, NULL, NULL, 0, 0};
+    if (!file.isDir && !sourceOpen(file, src)) {
+        sourceClose(src);
+        return false;
+    }
+    size_t size = src.size;
+
+    spiffs_obj_id objId = layout.nextObjId++;
+    spiffs_obj_id ixId = objId | SPIFFS_OBJ_ID_IX_FLAG;
+    u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(fs);
+    u32_t dataPages = (size + dataPageSize - 1) / dataPageSize;
+
+    spiffs_page_ix hdrPix;
+    if (!layoutAllocPage(layout, ixId, &hdrPix)) {
+        sourceClose(src);
+        return false;
+    }
+    u8_t* hdrPage = m_flashmem + SPIFFS_PAGE_TO_PADDR(fs, hdrPix);
+    u8_t* ixPage = hdrPage;
+    spiffs_page_ix* ixEntries = (spiffs_page_ix*)(hdrPage + sizeof(spiffs_page_object_ix_header));
+
+    for (u32_t spix = 0; spix < dataPages; ++spix) {
+        spiffs_span_ix ixSpix = SPIFFS_OBJ_IX_ENTRY_SPAN_IX(fs, spix);
+        if (ixSpix > 0 && SPIFFS_OBJ_IX_ENTRY(fs, spix) == 0) {
+            // continue in a new object index page
+            spiffs_page_ix ixPix;
+            if (!layoutAllocPage(layout, ixId, &ixPix)) {
+                sourceClose(src);
+                return false;
+            }
+            ixPage = m_flashmem + SPIFFS_PAGE_TO_PADDR(fs, ixPix);
+            spiffs_page_object_ix* ix = (spiffs_page_object_ix*)ixPage;
+            ix->p_hdr.obj_id = ixId;
+            ix->p_hdr.span_ix = ixSpix;
+            ix->p_hdr.flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_USED);
+            ixEntries = (spiffs_page_ix*)(ixPage + sizeof(spiffs_page_object_ix));
+        }
+
+        spiffs_page_ix dataPix;
+        if (!layoutAllocPage(layout, objId, &dataPix)) {
+            sourceClose(src);
+            return false;
+        }
+        u8_t* dataPage = m_flashmem + SPIFFS_PAGE_TO_PADDR(fs, dataPix);
+        spiffs_page_header* ph = (spiffs_page_header*)dataPage;
+        ph->obj_id = objId;
+        ph->span_ix = spix;
+        ph->flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_USED);
+
+        size_t len = std::min((size_t)dataPageSize, size - (size_t)spix * dataPageSize);
+        if (sourceRead(src, dataPage + sizeof(spiffs_page_header), len) != len) {
+            sourceClose(src);
+            return fail("failed to read source of " + file.name);
+        }
+        ixEntries[SPIFFS_OBJ_IX_ENTRY(fs, spix)] = dataPix;
+    }
+    if (!file.isDir) {
+        sourceClose(src);
+    }
+
+    spiffs_page_object_ix_header* hdr = (spiffs_page_object_ix_header*)hdrPage;
+    hdr->p_hdr.obj_id = ixId;
+    hdr->p_hdr.span_ix = 0;
+    hdr->p_hdr.flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_USED);
+    hdr->size = size ? (u32_t)size : SPIFFS_UNDEFINED_LEN;
+    hdr->type = SPIFFS_TYPE_FILE;
+    strncpy((char*)hdr->name, file.name.c_str(), SPIFFS_OBJ_NAME_LEN);
+#if defined (CONFIG_SPIFFS_USE_MTIME) || defined (CONFIG_SPIFFS_USE_DIR)
+    spiffs_meta_t meta;
+    spiffs_fill_meta(&meta, file.isDir ? SPIFFS_TYPE_DIR : SPIFFS_TYPE_FILE, file.mtime);
+    memcpy(hdr->meta, &meta, std::min(sizeof(meta), (size_t)SPIFFS_OBJ_META_LEN));
+#endif
+
+    return true;
+}
+
+/**
+ * @brief Build the image in one sequential pass, without the spiffs runtime.
+ * @param files Entries to write, in this order.
+ * @return True or false.
+ *
+ * Blocks are erased and stamped exactly as SPIFFS_format() does, then
+ * objects get consecutive ids and consecutive pages in the given order.
+ * The last two blocks are kept free, like the runtime allocator does,
+ * so the device can still write to and garbage collect the image.
+ */
+bool Image::layoutFiles(const std::vector<SourceFile>& files) {
+    Layout layout;
+    memset(&layout.fs, 0, sizeof(layout.fs));
+    spiffs* fs = &layout.fs;
+    fs->cfg.phys_addr = 0;
+    fs->cfg.phys_size = (u32_t) m_size;
+    fs->cfg.phys_erase_block = m_blockSize;
+    fs->cfg.log_block_size = m_blockSize;
+    fs->cfg.log_page_size = m_pageSize;
+    fs->block_count = SPIFFS_CFG_PHYS_SZ(fs) / SPIFFS_CFG_LOG_BLOCK_SZ(fs);
+    layout.nextPix = 0;
+    layout.usableBlocks = fs->block_count > 2 ? fs->block_count - 2 : 0;
+    layout.nextObjId = 1;
+
+#if SPIFFS_USE_MAGIC
+    if (!SPIFFS_CHECK_MAGIC_POSSIBLE(fs)) {
+        return fail("no room for magic with this page and block size");
+    }
+#endif
+
+    memset(m_flashmem, 0xff, m_size);
+    for (spiffs_block_ix bix = 0; bix < fs->block_count; ++bix) {
+        spiffs_obj_id eraseCount = 0;
+        memcpy(m_flashmem + SPIFFS_ERASE_COUNT_PADDR(fs, bix), &eraseCount, sizeof(eraseCount));
+#if SPIFFS_USE_MAGIC
+        spiffs_obj_id magic = SPIFFS_MAGIC(fs, bix);
+        memcpy(m_flashmem + SPIFFS_MAGIC_PADDR(fs, bix), &magic, sizeof(magic));
+#endif
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const SourceFile& file = files[i];
+#ifndef CONFIG_SPIFFS_USE_DIR
+        if (file.isDir) {
+            continue;
+        }
+#endif
+        if (m_log) *m_log << file.name << (file.isDir ? " [D]" : "") << std::endl;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!layoutFile(layout, file)) {
+            return false;
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        m_importedBytes += file.size;
+        m_importSeconds += seconds;
+        if (m_log && m_debugLevel > 0 && !file.isDir) {
+            printThroughput(*m_log, "file written", file.size, seconds);
+        }
+    }
+
+    return true;
+}
+
+void Image::checkReport(spiffs* fs, spiffs_check_type type, spiffs_check_report report, u32_t arg1, u32_t arg2) {
+    Image* img = (Image*)fs->user_data;
+    if (report != SPIFFS_CHECK_PROGRESS) {
+        if (img->m_err) {
+            *img->m_err << "check: type " << type << " report " << report << " (" << arg1 << ", " << arg2 << ")" << std::endl;
+        }
+        img->m_checkIssues++;
+    }
+}
+
+bool Image::check() {
+    m_checkIssues = 0;
+    if (!mount()) {
+        return false;
+    }
+    m_fs.check_cb_f = checkReport;
+    int res = SPIFFS_check(&m_fs);
+    m_fs.check_cb_f = NULL;
+    unmount();
+    if (res != SPIFFS_OK || m_checkIssues != 0) {
+        std::ostringstream message;
+        message << "image check failed (" << res << ")";
+        return fail(message.str());
+    }
+    return true;
+}
+
+// Updating
+
+bool Image::hashSource(const SourceFile& file, uint64_t* hash) {
+    if (!hashSourceFile(file, hash)) {
+        return fail("failed to read " + file.path);
+    }
+    return true;
+}
+
+bool Image::hashFile(const std::string& name, uint64_t* hash) {
+    spiffs_file src = SPIFFS_open(&m_fs, name.c_str(), SPIFFS_RDONLY, 0);
+    if (src < 0) {
+        SPIFFS_clearerr(&m_fs);
+        return false;
+    }
+    std::vector<uint8_t> chunk(s_importChunkSize);
+    *hash = HASH_INIT;
+    s32_t len;
+    while ((len = SPIFFS_read(&m_fs, src, &chunk[0], chunk.size())) > 0) {
+        *hash = hashUpdate(*hash, &chunk[0], len);
+    }
+    bool ok = len == 0 || m_fs.err_code == SPIFFS_ERR_END_OF_OBJECT;
+    SPIFFS_close(&m_fs, src);
+    SPIFFS_clearerr(&m_fs);
+    return ok;
+}
+
+/**
+ * @brief Tell whether a file in the image matches its source.
+ *
+ * Size and, when available, the modification time kept in the metadata
+ * are compared; with compare hash set the contents are compared as well.
+ */
+bool Image::fileUnchanged(const SourceFile& file, const FileInfo& info) {
+    if (info.isDir || info.size != file.size) {
+        return false;
+    }
+#ifdef CONFIG_SPIFFS_USE_MTIME
+    if (info.mtime != (time_t)(s32_t)file.mtime) {
+        return false;
+    }
+#endif
+    if (m_compareHash) {
+        uint64_t srcHash, imgHash;
+        if (!hashSource(file, &srcHash) || !hashFile(info.name, &imgHash)) {
+            return false;
+        }
+        return srcHash == imgHash;
+    }
+    return true;
+}
+
+bool Image::update(const std::vector<SourceFile>& files) {
+    std::vector<FileInfo> entries;
+    if (!list(entries)) {
+        return false;
+    }
+    std::map<std::string, FileInfo> present;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        present[entries[i].name] = entries[i];
+    }
+
+    std::set<std::string> wanted;
+    for (size_t i = 0; i < files.size(); ++i) {
+#ifndef CONFIG_SPIFFS_USE_DIR
+        if (files[i].isDir) {
+            continue;
+        }
+#endif
+        wanted.insert(files[i].name);
+    }
+
+#if SPIFFS_NAME_INDEX
+    // an existing table is image metadata, rebuilt below, not a stale file
+    bool nameIndex = m_nameIndex;
+    if (wanted.count(SPIFFS_NAME_INDEX_FILE) == 0 && present.erase(SPIFFS_NAME_INDEX_FILE) > 0) {
+        nameIndex = true;
+    }
+#endif
+
+    unsigned added = 0, updated = 0, removed = 0, unchanged = 0;
+
+    // Remove what is gone first, so its pages can be reclaimed
+    for (std::map<std::string, FileInfo>::iterator it = present.begin(); it != present.end(); ++it) {
+        if (wanted.count(it->first) == 0) {
+            if (m_log) *m_log << it->first << " [removed]" << std::endl;
+            if (SPIFFS_remove(&m_fs, it->first.c_str()) < 0) {
+                return failSpiffs("SPIFFS_remove");
+            }
+            removed++;
+        }
+    }
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const SourceFile& file = files[i];
+        if (wanted.count(file.name) == 0) {
+            continue;
+        }
+
+        std::map<std::string, FileInfo>::iterator it = present.find(file.name);
+        bool exists = (it != present.end());
+        if (exists) {
+            bool same = file.isDir ? it->second.isDir : fileUnchanged(file, it->second);
+            if (same) {
+                if (m_log && m_debugLevel > 0) {
+                    *m_log << file.name << " [unchanged]" << std::endl;
+                }
+                unchanged++;
+                continue;
+            }
+            if (file.isDir || it->second.isDir) {
+                // type changed, recreate from scratch
+                if (SPIFFS_remove(&m_fs, file.name.c_str()) < 0) {
+                    return failSpiffs("SPIFFS_remove");
+                }
+            }
+        }
+
+        if (m_log) *m_log << file.name << (file.isDir ? " [D]" : "") << (exists ? " [updated]" : " [added]") << std::endl;
+        if (!(file.isDir ? addDir(file) : addFile(file))) {
+            return false;
+        }
+        if (exists) {
+            updated++;
+        } else {
+            added++;
+        }
+    }
+
+#if SPIFFS_NAME_INDEX
+    if (nameIndex && !writeNameIndex()) {
+        return false;
+    }
+#endif
+    unmount();
+    if (m_log) {
+        *m_log << "added: " << added << ", updated: " << updated << ", removed: " << removed
+               << ", unchanged: " << unchanged << std::endl;
+    }
+    return true;
+}
+
+// Reading
+
+bool Image::list(std::vector<FileInfo>& files) {
+    if (!mount()) {
+        return false;
+    }
+    spiffs_DIR dir;
+    spiffs_dirent ent;
+    if (!SPIFFS_opendir(&m_fs, 0, &dir)) {
+        return failSpiffs("SPIFFS_opendir");
+    }
+    while (SPIFFS_readdir(&dir, &ent)) {
+        FileInfo info;
+        info.name = (const char*)ent.name;
+        info.size = ent.size;
+        info.isDir = spiffs_meta_is_dir(ent.type, ent.meta);
+        info.mtime = spiffs_meta_mtime(ent.meta);
+        info.id = ent.obj_id;
+        info.pix = ent.pix;
+        files.push_back(info);
+    }
+    SPIFFS_closedir(&dir);
+    return true;
+}
+
+bool Image::stat(const std::string& name, FileInfo& info) {
+    if (!mount()) {
+        return false;
+    }
+    spiffs_stat s;
+    if (SPIFFS_stat(&m_fs, name.c_str(), &s) < 0) {
+        return failSpiffs("SPIFFS_stat");
+    }
+    info.name = (const char*)s.name;
+    info.size = s.size;
+    info.isDir = spiffs_meta_is_dir(s.type, s.meta);
+    info.mtime = spiffs_meta_mtime(s.meta);
+    info.id = s.obj_id;
+    info.pix = s.pix;
+    return true;
+}
+
+bool Image::readFile(const std::string& name, std::vector<uint8_t>& data) {
+    FileInfo info;
+    if (!stat(name, info)) {
+        return false;
+    }
+    spiffs_file src = SPIFFS_open(&m_fs, name.c_str(), SPIFFS_RDONLY, 0);
+    if (src < 0) {
+        return failSpiffs("SPIFFS_open");
+    }
+    data.resize(info.size);
+    s32_t len = data.empty() ? 0 : SPIFFS_read(&m_fs, src, &data[0], data.size());
+    SPIFFS_close(&m_fs, src);
+    if (len != (s32_t)data.size()) {
+        return failSpiffs("SPIFFS_read");
+    }
+    return true;
+}
+
+#if SPIFFS_NAME_INDEX
+bool Image::writeNameIndex() {
+    for (int tries = 0; tries < 3; ++tries) {
+        std::vector<FileInfo> files;
+        if (!list(files)) {
+            return false;
+        }
+        std::vector<spiffs_name_index_entry> entries;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].name == SPIFFS_NAME_INDEX_FILE) {
+                continue;
+            }
+            u8_t name[SPIFFS_OBJ_NAME_LEN] = {0};
+            strncpy((char*)name, files[i].name.c_str(), SPIFFS_OBJ_NAME_LEN);
+            spiffs_name_index_entry entry = {spiffs_name_index_hash(name), files[i].pix};
+            entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](const spiffs_name_index_entry& a, const spiffs_name_index_entry& b) {
+            return a.hash != b.hash ? a.hash < b.hash : a.pix < b.pix;
+        });
+
+        spiffs_name_index_header header = {SPIFFS_NAME_INDEX_MAGIC, (u32_t)entries.size()};
+        std::vector<uint8_t> table((const uint8_t*)&header, (const uint8_t*)(&header + 1));
+        if (!entries.empty()) {
+            table.insert(table.end(), (const uint8_t*)&entries[0], (const uint8_t*)(&entries[0] + entries.size()));
+        }
+        if (table.size() > (size_t)SPIFFS_OBJ_HDR_IX_LEN(&m_fs) * SPIFFS_DATA_PAGE_SIZE(&m_fs)) {
+            return fail("too many files for a name index with this page size");
+        }
+        if (!writeFile(SPIFFS_NAME_INDEX_FILE, &table[0], table.size(), 0)) {
+            return false;
+        }
+
+        // garbage collection may have moved objects to make room for the table
+        std::vector<FileInfo> after;
+        if (!list(after)) {
+            return false;
+        }
+        std::map<std::string, spiffs_page_ix> pages;
+        for (size_t i = 0; i < after.size(); ++i) {
+            pages[after[i].name] = after[i].pix;
+        }
+        bool moved = false;
+        for (size_t i = 0; i < files.size() && !moved; ++i) {
+            moved = files[i].name != SPIFFS_NAME_INDEX_FILE && pages[files[i].name] != files[i].pix;
+        }
+        if (!moved) {
+            if (m_log) *m_log << SPIFFS_NAME_INDEX_FILE << " [" << entries.size() << " names]" << std::endl;
+            return true;
+        }
+    }
+    return fail("objects keep moving while writing the name index, image too full");
+}
+#endif
+
+bool Image::readAll(size_t chunkSize) {
+    std::vector<FileInfo> files;
+    if (!list(files)) {
+        return false;
+    }
+
+    // start cold: nothing of the listing left in the spiffs cache
+    unmount();
+    if (!mount()) {
+        return false;
+    }
+    resetReadCount();
+
+    std::vector<uint8_t> chunk(chunkSize);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].isDir) {
+            continue;
+        }
+        spiffs_file src = SPIFFS_open(&m_fs, files[i].name.c_str(), SPIFFS_RDONLY, 0);
+        if (src < 0) {
+            return failSpiffs("SPIFFS_open");
+        }
+        s32_t len;
+        while ((len = SPIFFS_read(&m_fs, src, &chunk[0], chunk.size())) > 0) {
+        }
+        SPIFFS_close(&m_fs, src);
+        if (len < 0 && SPIFFS_errno(&m_fs) != SPIFFS_ERR_END_OF_OBJECT) {
+            return failSpiffs("SPIFFS_read");
+        }
+    }
+    return true;
+}
+
+bool Image::simulate(Simulation& sim, size_t chunkSize) {
+    std::vector<FileInfo> files;
+    if (!list(files)) {
+        return false;
+    }
+    sim = Simulation();
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!files[i].isDir) {
+            FileCost cost;
+            cost.name = files[i].name;
+            cost.size = files[i].size;
+            sim.files.push_back(cost);
+        }
+    }
+    auto take = [this](ReadCost& cost) {
+        cost.ops += m_readOps;
+        cost.bytes += m_readBytes;
+        resetReadCount();
+    };
+
+    // each step starts cold, with nothing left in the spiffs cache
+    unmount();
+    resetReadCount();
+    if (!mount()) {
+        return false;
+    }
+    take(sim.mount);
+
+    std::vector<uint8_t> chunk(chunkSize);
+    for (size_t i = 0; i < sim.files.size(); ++i) {
+        FileCost& file = sim.files[i];
+        spiffs_file src = SPIFFS_open(&m_fs, file.name.c_str(), SPIFFS_RDONLY, 0);
+        if (src < 0) {
+            return failSpiffs("SPIFFS_open");
+        }
+        take(file.open);
+        s32_t len;
+        while ((len = SPIFFS_read(&m_fs, src, &chunk[0], chunk.size())) > 0) {
+        }
+        SPIFFS_close(&m_fs, src);
+        if (len < 0 && SPIFFS_errno(&m_fs) != SPIFFS_ERR_END_OF_OBJECT) {
+            return failSpiffs("SPIFFS_read");
+        }
+        take(file.read);
+        sim.openRead.ops += file.open.ops + file.read.ops;
+        sim.openRead.bytes += file.open.bytes + file.read.bytes;
+    }
+
+    unmount();
+    if (!mount()) {
+        return false;
+    }
+    resetReadCount();
+    for (size_t i = 0; i < sim.files.size(); ++i) {
+        spiffs_stat s;
+        if (SPIFFS_stat(&m_fs, sim.files[i].name.c_str(), &s) < 0) {
+            return failSpiffs("SPIFFS_stat");
+        }
+        take(sim.files[i].stat);
+        sim.stat.ops += sim.files[i].stat.ops;
+        sim.stat.bytes += sim.files[i].stat.bytes;
+    }
+    return true;
+}
+
+bool Image::largestNewFile(size_t* size) {
+    Analysis analysis;
+    if (!analyze(analysis)) {
+        return false;
+    }
+    std::vector<FileInfo> files;
+    if (!list(files)) {
+        return false;
+    }
+    std::set<std::string> names;
+    for (size_t i = 0; i < files.size(); ++i) {
+        names.insert(files[i].name);
+    }
+    std::string name = "/.largest_new_file";
+    while (names.count(name)) {
+        name += "_";
+    }
+
+    Image scratch(m_size, m_pageSize, m_blockSize);
+    std::vector<uint8_t> data((analysis.freePages + analysis.deletedPages) * SPIFFS_DATA_PAGE_SIZE(&m_fs));
+    auto fits = [&](size_t len) {
+        return scratch.load(m_flashmem, m_size) && scratch.writeFile(name, data.empty() ? NULL : &data[0], len, 0);
+    };
+
+    *size = 0;
+    if (!fits(0)) {
+        return true;
+    }
+    size_t lo = 0;
+    size_t hi = data.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo + 1) / 2;
+        if (fits(mid)) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    *size = lo;
+    return true;
+}
+
+/**
+ * @brief Share the flash buffer of another image, to read it with a spiffs instance of our own.
+ */
+void Image::borrow(const Image& other) {
+    close();
+    m_flashmem = other.m_flashmem;
+    m_flashmemBorrowed = true;
+}
+
+bool Image::unpackFile(const FileInfo& info, const std::string& destPath) {
+    // open through the index header page found by list(), without a name lookup
+    spiffs_file src = SPIFFS_open_by_page(&m_fs, info.pix, SPIFFS_RDONLY, 0);
+    if (src < 0) {
+        return failSpiffs("SPIFFS_open");
+    }
+    FILE* dst = fopen(destPath.c_str(), "wb");
+    if (!dst) {
+        SPIFFS_close(&m_fs, src);
+        return fail("failed to open " + destPath + " for writing");
+    }
+
+    std::vector<uint8_t> chunk(std::min(info.size, s_importChunkSize));
+    size_t left = info.size;
+    bool ok = true;
+    while (ok && left > 0) {
+        size_t len = std::min(left, chunk.size());
+        if (SPIFFS_read(&m_fs, src, &chunk[0], len) != (s32_t)len) {
+            ok = failSpiffs("SPIFFS_read");
+        } else if (fwrite(&chunk[0], 1, len, dst) != len) {
+            ok = fail("failed to write " + destPath);
+        }
+        left -= len;
+    }
+
+    SPIFFS_close(&m_fs, src);
+    if (fclose(dst) != 0 && ok) {
+        ok = fail("failed to write " + destPath);
+    }
+    return ok;
+}
+
+bool Image::hashFiles(const std::vector<FileInfo>& files, std::vector<uint64_t>& hashes, size_t chunkSize) {
+    if (!mount()) {
+        return false;
+    }
+    hashes.assign(files.size(), HASH_INIT);
+    std::vector<uint8_t> chunk(chunkSize);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (files[i].isDir) {
+            continue;
+        }
+        spiffs_file src = SPIFFS_open_by_page(&m_fs, files[i].pix, SPIFFS_RDONLY, 0);
+        if (src < 0) {
+            return failSpiffs("SPIFFS_open");
+        }
+        size_t left = files[i].size;
+        while (left > 0) {
+            size_t len = std::min(left, chunk.size());
+            if (SPIFFS_read(&m_fs, src, &chunk[0], len) != (s32_t)len) {
+                SPIFFS_close(&m_fs, src);
+                return failSpiffs("SPIFFS_read");
+            }
+            hashes[i] = hashUpdate(hashes[i], &chunk[0], len);
+            left -= len;
+        }
+        SPIFFS_close(&m_fs, src);
+    }
+    return true;
+}
+
+bool Image::unpack(const std::string& destDir, unsigned jobs) {
+    std::vector<FileInfo> files;
+    if (!list(files)) {
+        return false;
+    }
+
+    std::string dest = destDir;
+    if (!dirExists(dest.c_str())) {
+        if (m_log) *m_log << "Directory " << dest << " does not exists. Try to create it." << std::endl;
+        if (!dirCreate(dest.c_str())) {
+            return fail("can not create directory " + dest);
+        }
+    }
+
+    // Create the directory tree up front, each directory once; directories
+    // are not always objects of their own. Parents sort before their children.
+    std::set<std::string> dirs;
+    std::vector<size_t> regular;
+    for (size_t i = 0; i < files.size(); ++i) {
+        const std::string& name = files[i].name;
+        for (size_t pos = name.find('/', 1); pos != std::string::npos; pos = name.find('/', pos + 1)) {
+            dirs.insert(name.substr(0, pos));
+        }
+        if (files[i].isDir) {
+            dirs.insert(name);
+#if SPIFFS_NAME_INDEX
+        } else if (name == SPIFFS_NAME_INDEX_FILE) {
+            continue;   // image metadata
+#endif
+        } else {
+            regular.push_back(i);
+        }
+    }
+    for (std::set<std::string>::iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        if (!dirCreate((dest + *it).c_str())) {
+            return fail("can not create directory " + dest + *it);
+        }
+    }
+
+    if (jobs == 0) {
+        jobs = std::thread::hardware_concurrency();
+    }
+    jobs = std::max(1u, std::min(jobs, (unsigned)regular.size()));
+
+    // Worker 0 uses this instance, the others get their own over the same flash
+    std::vector<std::unique_ptr<Image> > readers;
+    for (unsigned i = 1; i < jobs; ++i) {
+        readers.push_back(std::unique_ptr<Image>(new Image(m_size, m_pageSize, m_blockSize)));
+        readers.back()->borrow(*this);
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::string firstError;
+    std::mutex lock;
+    auto worker = [&](Image* reader) {
+        if (!reader->mount()) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!failed.exchange(true)) {
+                firstError = reader->m_error;
+            }
+            return;
+        }
+        for (size_t i; !failed && (i = next++) < regular.size(); ) {
+            const FileInfo& file = files[regular[i]];
+            std::string destPath = dest + file.name;
+            bool ok = reader->unpackFile(file, destPath);
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!ok) {
+                if (!failed.exchange(true)) {
+                    firstError = reader->m_error;
+                }
+                return;
+            }
+            if (m_log) {
+                *m_log << file.name << '\t' << " > " << destPath << '\t'
+                       << "size: " << file.size << " Bytes" << std::endl;
+            }
+        }
+    };
+
+    std::ostream* err = m_err;
+    m_err = NULL;   // the first error is reported once, below
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < readers.size(); ++i) {
+        threads.push_back(std::thread(worker, readers[i].get()));
+    }
+    worker(this);
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    m_err = err;
+
+    return !failed || fail(firstError);
+}
+
+bool Image::visualize(std::ostream& out) {
+    if (!mount()) {
+        return false;
+    }
+
+    spiffs* fs = &m_fs;
+    u32_t entries = SPIFFS_PAGES_PER_BLOCK(fs) - SPIFFS_OBJ_LOOKUP_PAGES(fs);
+    for (spiffs_block_ix bix = 0; bix < fs->block_count; ++bix) {
+        const uint8_t* lu = m_flashmem + SPIFFS_BLOCK_TO_PADDR(fs, bix);
+        out << std::setw(4) << bix << ' ';
+        for (u32_t entry = 0; entry < entries; ++entry) {
+            if (entry > 0 && (entry & 0x3f) == 0) {
+                out << std::endl << "     ";
+            }
+            spiffs_obj_id objId;
+            memcpy(&objId, lu + entry * sizeof(spiffs_obj_id), sizeof(objId));
+            if (objId == SPIFFS_OBJ_ID_FREE) {
+                out << '_';
+            } else if (objId == SPIFFS_OBJ_ID_DELETED) {
+                out << '/';
+            } else if (objId & SPIFFS_OBJ_ID_IX_FLAG) {
+                out << 'i';
+            } else {
+                out << 'd';
+            }
+        }
+        spiffs_obj_id eraseCount;
+        memcpy(&eraseCount, m_flashmem + SPIFFS_ERASE_COUNT_PADDR(fs, bix), sizeof(eraseCount));
+        out << "\tera_cnt: ";
+        if (eraseCount != (spiffs_obj_id)-1) {
+            out << eraseCount << std::endl;
+        } else {
+            out << "N/A" << std::endl;
+        }
+    }
+
+    u32_t total, used;
+    SPIFFS_info(fs, &total, &used);
+    out << "era_cnt_max: " << fs->max_erase_count << std::endl;
+    out << "blocks:      " << fs->block_count << std::endl;
+    out << "free_blocks: " << fs->free_blocks << std::endl;
+    out << "total: " << total << std::endl << "used: " << used << std::endl;
+    return true;
+}
+
+// Analysis
+
+bool Image::analyze(Analysis& a) {
+    if (!mount()) {
+        return false;
+    }
+
+    spiffs* fs = &m_fs;
+    u32_t entries = SPIFFS_PAGES_PER_BLOCK(fs) - SPIFFS_OBJ_LOOKUP_PAGES(fs);
+    u32_t dataPageSize = SPIFFS_DATA_PAGE_SIZE(fs);
+
+    a = Analysis();
+    a.imageSize = m_size;
+    a.pageSize = m_pageSize;
+    a.blockSize = m_blockSize;
+    a.blockCount = fs->block_count;
+    a.pagesPerBlock = SPIFFS_PAGES_PER_BLOCK(fs);
+    a.lookupPagesPerBlock = SPIFFS_OBJ_LOOKUP_PAGES(fs);
+    a.minEraseCount = (spiffs_obj_id)-1;
+    a.lookupBytes = a.blockCount * a.lookupPagesPerBlock * m_pageSize;
+    a.gcVictimBlock = -1;
+
+    // data pages of every object, as (span index, page index)
+    std::map<spiffs_obj_id, std::vector<std::pair<spiffs_span_ix, spiffs_page_ix> > > dataPages;
+    std::map<spiffs_obj_id, FileStats> objects;
+
+    for (spiffs_block_ix bix = 0; bix < fs->block_count; ++bix) {
+        const uint8_t* lu = m_flashmem + SPIFFS_BLOCK_TO_PADDR(fs, bix);
+        BlockStats block = BlockStats();
+        for (u32_t entry = 0; entry < entries; ++entry) {
+            spiffs_obj_id objId;
+            memcpy(&objId, lu + entry * sizeof(spiffs_obj_id), sizeof(objId));
+            if (objId == SPIFFS_OBJ_ID_FREE) {
+                block.free++;
+                continue;
+            }
+            if (objId == SPIFFS_OBJ_ID_DELETED) {
+                block.deleted++;
+                continue;
+            }
+            block.used++;
+
+            spiffs_page_ix pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry);
+            const uint8_t* page = m_flashmem + SPIFFS_PAGE_TO_PADDR(fs, pix);
+            spiffs_page_header ph;
+            memcpy(&ph, page, sizeof(ph));
+            spiffs_obj_id id = objId & ~SPIFFS_OBJ_ID_IX_FLAG;
+            FileStats& file = objects[id];
+            file.id = id;
+            if ((objId & SPIFFS_OBJ_ID_IX_FLAG) == 0) {
+                dataPages[id].push_back(std::make_pair((spiffs_span_ix)ph.span_ix, pix));
+                continue;
+            }
+            file.indexPages++;
+            if (ph.span_ix == 0) {
+                spiffs_page_object_ix_header hdr;
+                memcpy(&hdr, page, sizeof(hdr));
+                file.name.assign((const char*)hdr.name, strnlen((const char*)hdr.name, SPIFFS_OBJ_NAME_LEN));
+                file.size = hdr.size == SPIFFS_UNDEFINED_LEN ? 0 : hdr.size;
+#if SPIFFS_OBJ_META_LEN
+                file.isDir = spiffs_meta_is_dir(hdr.type, hdr.meta);
+#else
+                file.isDir = hdr.type == SPIFFS_TYPE_DIR;
+#endif
+            }
+        }
+        memcpy(&block.eraseCount, m_flashmem + SPIFFS_ERASE_COUNT_PADDR(fs, bix), sizeof(block.eraseCount));
+
+        a.usedPages += block.used;
+        a.deletedPages += block.deleted;
+        a.freePages += block.free;
+        if (block.free == entries) {
+            a.freeBlocks++;
+        }
+        if (block.eraseCount != (spiffs_obj_id)-1) {
+            a.minEraseCount = std::min(a.minEraseCount, block.eraseCount);
+            a.maxEraseCount = std::max(a.maxEraseCount, block.eraseCount);
+        }
+        if (block.deleted > 0 && (a.gcVictimBlock < 0 || block.deleted > a.blocks[a.gcVictimBlock].deleted)) {
+            a.gcVictimBlock = bix;
+        }
+        a.blocks.push_back(block);
+    }
+
+    for (std::map<spiffs_obj_id, FileStats>::iterator it = objects.begin(); it != objects.end(); ++it) {
+        FileStats& file = it->second;
+        std::vector<std::pair<spiffs_span_ix, spiffs_page_ix> >& pages = dataPages[it->first];
+        std::sort(pages.begin(), pages.end());
+        file.dataPages = pages.size();
+        file.fragments = pages.empty() ? 0 : 1;
+        for (size_t i = 1; i < pages.size(); ++i) {
+            spiffs_page_ix next = pages[i - 1].second + 1;
+            if (SPIFFS_IS_LOOKUP_PAGE(fs, next)) {
+                next += SPIFFS_OBJ_LOOKUP_PAGES(fs);
+            }
+            if (pages[i].second != next) {
+                file.fragments++;
+            }
+        }
+        file.contiguity = pages.size() > 1 ? (double)(pages.size() - file.fragments) / (pages.size() - 1) : 1.0;
+
+        a.payloadBytes += file.size;
+        a.pageHeaderBytes += file.dataPages * sizeof(spiffs_page_header);
+        a.indexBytes += file.indexPages * m_pageSize;
+        size_t capacity = file.dataPages * dataPageSize;
+        a.slackBytes += capacity > file.size ? capacity - file.size : 0;
+        a.files.push_back(file);
+    }
+    a.deletedBytes = a.deletedPages * m_pageSize;
+    if (a.minEraseCount == (spiffs_obj_id)-1) {
+        a.minEraseCount = 0;
+    }
+
+    size_t usablePages = a.blockCount > 2 ? (a.blockCount - 2) * entries : 0;
+    size_t occupied = a.usedPages + a.deletedPages;
+    a.gcPressure = usablePages == 0 ? 1.0 : std::min(1.0, (double)occupied / usablePages);
+    if (a.gcVictimBlock >= 0) {
+        const BlockStats& victim = a.blocks[a.gcVictimBlock];
+        a.gcVictimMoveCost = (double)victim.used / victim.deleted;
+    }
+    return true;
+}
+
+static void writeJsonString(std::ostream& out, const std::string& value) {
+    out << '"';
+    for (size_t i = 0; i < value.size(); ++i) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+void writeAnalysisJson(std::ostream& out, const Analysis& a) {
+    out << "{" << std::endl;
+    out << "  \"geometry\": {\"image_size\": " << a.imageSize << ", \"page_size\": " << a.pageSize
+        << ", \"block_size\": " << a.blockSize << ", \"blocks\": " << a.blockCount
+        << ", \"pages_per_block\": " << a.pagesPerBlock
+        << ", \"lookup_pages_per_block\": " << a.lookupPagesPerBlock << "}," << std::endl;
+    out << "  \"pages\": {\"used\": " << a.usedPages << ", \"deleted\": " << a.deletedPages
+        << ", \"free\": " << a.freePages << ", \"free_blocks\": " << a.freeBlocks << "}," << std::endl;
+    out << "  \"wear\": {\"min_erase_count\": " << a.minEraseCount
+        << ", \"max_erase_count\": " << a.maxEraseCount << "}," << std::endl;
+    out << "  \"bytes\": {\"payload\": " << a.payloadBytes << ", \"page_headers\": " << a.pageHeaderBytes
+        << ", \"index\": " << a.indexBytes << ", \"lookup\": " << a.lookupBytes
+        << ", \"slack\": " << a.slackBytes << ", \"deleted\": " << a.deletedBytes << "}," << std::endl;
+    out << "  \"gc\": {\"pressure\": " << a.gcPressure << ", \"victim_block\": " << a.gcVictimBlock
+        << ", \"victim_move_cost\": " << a.gcVictimMoveCost << "}," << std::endl;
+
+    out << "  \"blocks\": [" << std::endl;
+    for (size_t i = 0; i < a.blocks.size(); ++i) {
+        const BlockStats& b = a.blocks[i];
+        out << "    {\"block\": " << i << ", \"used\": " << b.used << ", \"deleted\": " << b.deleted
+            << ", \"free\": " << b.free << ", \"erase_count\": ";
+        if (b.eraseCount == (spiffs_obj_id)-1) {
+            out << "null";
+        } else {
+            out << b.eraseCount;
+        }
+        out << "}" << (i + 1 < a.blocks.size() ? "," : "") << std::endl;
+    }
+    out << "  ]," << std::endl;
+
+    out << "  \"files\": [" << std::endl;
+    for (size_t i = 0; i < a.files.size(); ++i) {
+        const FileStats& f = a.files[i];
+        out << "    {\"name\": ";
+        writeJsonString(out, f.name);
+        out << ", \"id\": " << f.id << ", \"type\": \"" << (f.isDir ? "dir" : "file") << "\""
+            << ", \"size\": " << f.size << ", \"data_pages\": " << f.dataPages
+            << ", \"index_pages\": " << f.indexPages << ", \"fragments\": " << f.fragments
+            << ", \"contiguity\": " << f.contiguity << "}" << (i + 1 < a.files.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+static void writeReadCost(std::ostream& out, const ReadCost& cost, const FlashTiming& timing) {
+    double ms = cost.ops * timing.transactionUs / 1000.0 + cost.bytes / (timing.readMBps * 1000.0);
+    out << "{\"reads\": " << cost.ops << ", \"bytes\": " << cost.bytes << ", \"ms\": " << ms << "}";
+}
+
+void writeSimulationJson(std::ostream& out, const Simulation& sim, const FlashTiming& timing) {
+    out << "{" << std::endl;
+    out << "  \"flash\": {\"read_mbps\": " << timing.readMBps
+        << ", \"transaction_us\": " << timing.transactionUs << "}," << std::endl;
+    out << "  \"mount\": ";
+    writeReadCost(out, sim.mount, timing);
+    out << "," << std::endl << "  \"open_read\": ";
+    writeReadCost(out, sim.openRead, timing);
+    out << "," << std::endl << "  \"stat\": ";
+    writeReadCost(out, sim.stat, timing);
+    out << "," << std::endl;
+
+    out << "  \"files\": [" << std::endl;
+    for (size_t i = 0; i < sim.files.size(); ++i) {
+        const FileCost& f = sim.files[i];
+        out << "    {\"name\": ";
+        writeJsonString(out, f.name);
+        out << ", \"size\": " << f.size << ", \"open\": ";
+        writeReadCost(out, f.open, timing);
+        out << ", \"read\": ";
+        writeReadCost(out, f.read, timing);
+        out << ", \"stat\": ";
+        writeReadCost(out, f.stat, timing);
+        out << "}" << (i + 1 < sim.files.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl;
+    out << "}" << std::endl;
+}
+
+} // namespace mkspiffs
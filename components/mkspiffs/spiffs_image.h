@@ -0,0 +1,540 @@
+//
+//  spiffs_image.h
+//  make_spiffs
+//
+//  Library interface for building and reading spiffs images on the host.
+//  Nothing here touches global state or writes to stdout, so any number
+//  of images can be handled at once, from any number of threads, as long
+//  as each Image is used by one thread at a time.
+//
+
+#ifndef SPIFFS_IMAGE_H
+#define SPIFFS_IMAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <ostream>
+#include "spiffs.h"
+
+namespace mkspiffs {
+
+// 64-bit FNV-1a, used to compare file and image contents
+const uint64_t HASH_INIT = 14695981039346656037ULL;
+
+uint64_t hashUpdate(uint64_t hash, const uint8_t* data, size_t len);
+
+void printThroughput(std::ostream& out, const char* what, size_t bytes, double seconds);
+
+/**
+ * @brief Entry of a source tree to be packed into an image.
+ *
+ * Contents come from the host file at path, or from data when it is set.
+ */
+struct SourceFile {
+    std::string name;   // path inside the image
+    std::string path;   // path on the host
+    bool isDir;
+    size_t size;
+    time_t mtime;
+    std::shared_ptr<const std::vector<uint8_t> > data;
+
+    SourceFile() : isDir(false), size(0), mtime(0) {}
+};
+
+/**
+ * @brief Hash the contents of a source file with hashUpdate().
+ * @return False if the file can't be read.
+ */
+bool hashSourceFile(const SourceFile& file, uint64_t* hash);
+
+/**
+ * @brief Object stored in an image.
+ */
+struct FileInfo {
+    std::string name;
+    size_t size;
+    bool isDir;
+    time_t mtime;       // 0 unless the image keeps modification times
+    spiffs_obj_id id;
+    spiffs_page_ix pix; // object index header page
+};
+
+/**
+ * @brief Page usage and wear of one erase block.
+ */
+struct BlockStats {
+    size_t used;
+    size_t deleted;
+    size_t free;
+    spiffs_obj_id eraseCount;   // 0xffff if the block was never stamped
+};
+
+/**
+ * @brief Layout of one object in the image.
+ *
+ * Contiguity is the share of consecutive data page pairs (in span order)
+ * that are also physically consecutive, skipping lookup pages; fragments
+ * is the number of physically contiguous runs.
+ */
+struct FileStats {
+    std::string name;
+    spiffs_obj_id id;
+    size_t size;
+    bool isDir;
+    size_t dataPages;
+    size_t indexPages;
+    size_t fragments;
+    double contiguity;
+};
+
+/**
+ * @brief Result of Image::analyze().
+ *
+ * GC pressure is the share of the pages outside the two blocks the
+ * allocator keeps free that hold used or deleted pages: at 1 every new
+ * page has to be reclaimed by garbage collection first. The GC victim is
+ * the block the collector would pick, the one with the most deleted
+ * pages; its move cost is the number of used pages that have to be copied
+ * per deleted page reclaimed.
+ */
+struct Analysis {
+    size_t imageSize;
+    size_t pageSize;
+    size_t blockSize;
+    size_t blockCount;
+    size_t pagesPerBlock;
+    size_t lookupPagesPerBlock;
+
+    std::vector<BlockStats> blocks;
+    std::vector<FileStats> files;
+
+    size_t usedPages;
+    size_t deletedPages;
+    size_t freePages;
+    size_t freeBlocks;
+    spiffs_obj_id minEraseCount;
+    spiffs_obj_id maxEraseCount;
+
+    // Where the flash goes, in bytes
+    size_t payloadBytes;        // file contents
+    size_t pageHeaderBytes;     // headers of data pages
+    size_t indexBytes;          // index header and index pages
+    size_t lookupBytes;         // object lookup pages
+    size_t slackBytes;          // unused tails of last data pages
+    size_t deletedBytes;        // deleted pages, until garbage collected
+
+    double gcPressure;
+    long gcVictimBlock;         // -1 if no block has deleted pages
+    double gcVictimMoveCost;
+};
+
+/**
+ * @brief Write an analysis as JSON.
+ */
+void writeAnalysisJson(std::ostream& out, const Analysis& analysis);
+
+/**
+ * @brief Flash reads taken by one step of Image::simulate().
+ */
+struct ReadCost {
+    size_t ops;
+    size_t bytes;
+
+    ReadCost() : ops(0), bytes(0) {}
+};
+
+/**
+ * @brief Flash reads taken for one file by Image::simulate().
+ */
+struct FileCost {
+    std::string name;
+    size_t size;
+    ReadCost open;
+    ReadCost read;
+    ReadCost stat;
+};
+
+/**
+ * @brief Result of Image::simulate(): the flash reads firmware using the
+ *        image makes from boot on.
+ */
+struct Simulation {
+    ReadCost mount;             // SPIFFS_mount, the object lookup scan mostly
+    ReadCost openRead;          // every file opened by name and read to the end
+    ReadCost stat;              // every file stat'ed by name, after a fresh mount
+    std::vector<FileCost> files;
+};
+
+/**
+ * @brief SPI flash read timing: every read transaction takes a fixed
+ *        overhead (command, address, dummy cycles, driver) plus its bytes
+ *        at the read rate.
+ */
+struct FlashTiming {
+    double readMBps;            // 10^6 bytes per second
+    double transactionUs;
+};
+
+/**
+ * @brief Write a simulation as JSON, with the read costs turned into
+ *        milliseconds by the timing model.
+ */
+void writeSimulationJson(std::ostream& out, const Simulation& simulation, const FlashTiming& timing);
+
+/**
+ * @brief Collect the files and directories of a source tree.
+ * @param dirName Source directory, the image root.
+ * @param files Entries are appended here, each directory before its contents.
+ * @param addAllFiles Also take files that are normally ignored (.DS_Store, .git, ...).
+ * @param log Skipped entries are reported here, if not NULL.
+ * @return True or false.
+ */
+bool collectFiles(const std::string& dirName, std::vector<SourceFile>& files, bool addAllFiles, std::ostream* log);
+
+/**
+ * @brief Collect the files and directories of a tar (ustar, pax or GNU) stream.
+ *
+ * File contents are kept in memory. Directories the stream doesn't list
+ * are added before their first entry; links and devices are skipped.
+ * @param in Stream positioned at the first header, read up to the end of archive marker.
+ * @param files Entries are appended here, each directory before its contents.
+ * @param addAllFiles Also take files that are normally ignored (.DS_Store, .git, ...).
+ * @param log Skipped entries are reported here, if not NULL.
+ * @param error Set to the reason the stream could not be read.
+ * @return True or false.
+ */
+bool readTar(FILE* in, std::vector<SourceFile>& files, bool addAllFiles, std::ostream* log, std::string& error);
+
+/**
+ * @brief Read the order in which files of a source tree are accessed.
+ * @param path Hint list or boot trace. Every word naming a file of the
+ *             tree, as its path in the image or as a longer path ending in
+ *             it (/spiffs/www/index.html names /www/index.html), counts;
+ *             only the first mention of a file is kept. Lines starting
+ *             with '#' are skipped.
+ * @param files Source tree the words are matched against.
+ * @param names Image paths of the files mentioned, in order.
+ * @return False if the file can't be read.
+ */
+bool readAccessOrder(const std::string& path, const std::vector<SourceFile>& files, std::vector<std::string>& names);
+
+/**
+ * @brief Move the named files to the front of a source tree, in the given
+ *        order, each preceded by those of its directories not moved yet.
+ *
+ * Files are packed in list order, so they end up in the first pages of
+ * the image, where name lookups start scanning.
+ */
+void placeFirst(std::vector<SourceFile>& files, const std::vector<std::string>& names);
+
+/**
+ * @brief Read the erase count of every block from a wear profile.
+ * @param path Profile. Each line gives a block, a range of blocks ("4-11")
+ *             or every block not given otherwise ("*"), then an erase
+ *             count or a range of them ("100-400") to draw each block's
+ *             count from. Draws are repeatable: the same profile always
+ *             gives the same counts. Lines starting with '#' are skipped.
+ * @param blockCount Number of blocks of the image; a range starting past
+ *                   the last block is rejected.
+ * @param counts Set to the erase count of each block. Blocks the profile
+ *               leaves out get 0 unless a "*" line is given, not the
+ *               counts 0 to N-1 a format gives them.
+ * @param error Set to the reason the profile was rejected.
+ * @return True or false.
+ */
+bool readWearProfile(const std::string& path, size_t blockCount, std::vector<spiffs_obj_id>& counts, std::string& error);
+
+/**
+ * @brief Contents of source files that several images include.
+ *
+ * Files registered with share() are read from disk by the first image that
+ * needs them and dropped when the last of their users is done with them.
+ * One SourceCache can serve images built on different threads.
+ */
+class SourceCache {
+public:
+    /**
+     * @brief Keep the contents of a host file for the given number of users.
+     *
+     * Must be called before the images using the cache start packing.
+     */
+    void share(const std::string& path, int users);
+
+private:
+    struct Entry {
+        std::once_flag loaded;
+        bool ok;
+        std::vector<uint8_t> data;
+        std::atomic<int> users;
+    };
+    std::map<std::string, std::shared_ptr<Entry> > m_entries;
+
+    friend class Image;
+};
+
+enum ImageMode { IMAGE_READ, IMAGE_CREATE, IMAGE_UPDATE };
+
+/**
+ * @brief A spiffs image and the spiffs instance working on it.
+ *
+ * The image owns its flash buffer (in memory or a memory map of the image
+ * file), the spiffs work buffers, file descriptor table and cache. Methods
+ * return false on failure; error() then tells why.
+ */
+class Image {
+public:
+    Image(size_t size, size_t pageSize, size_t blockSize);
+    ~Image();
+
+    /**
+     * @brief Start from erased flash in memory.
+     */
+    bool create();
+
+    /**
+     * @brief Start from a copy of an image in memory; a short image reads as erased flash.
+     */
+    bool load(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Map an image file as flash memory.
+     * @param mode IMAGE_CREATE to create the image file anew,
+     *             IMAGE_READ to open an existing image for reading,
+     *             IMAGE_UPDATE to modify an existing image in place.
+     *
+     * Images opened for reading are mapped copy-on-write, so nothing done
+     * to them ever reaches the file. If the file is shorter than the image
+     * size, or mmap is not available, the image is read into an erased heap
+     * buffer. An image file is never written through other hard links to
+     * it: a created one replaces the old file, and one to update that has
+     * other links is buffered and saved as a new file.
+     */
+    bool open(const std::string& path, ImageMode mode);
+
+    /**
+     * @brief Unmount and release the flash buffer.
+     *
+     * A heap buffered image opened with IMAGE_CREATE or IMAGE_UPDATE is
+     * written back to its file first.
+     */
+    bool close();
+
+    /**
+     * @brief Write the flash contents to a file.
+     */
+    bool save(const std::string& path);
+
+    const uint8_t* data() const { return m_flashmem; }
+    size_t size() const { return m_size; }
+    size_t pageSize() const { return m_pageSize; }
+    size_t blockSize() const { return m_blockSize; }
+
+    /**
+     * @brief Format the image and write the given files into it.
+     *
+     * With direct layout set, the image is laid out in one sequential pass
+     * without the spiffs runtime and then checked by it. With name index
+     * set, a name index table is written after the files.
+     */
+    bool pack(const std::vector<SourceFile>& files);
+
+    /**
+     * @brief Bring the image in line with the given files.
+     *
+     * Only objects that differ are removed, added or rewritten, so pages of
+     * unchanged files stay where they are (unless garbage collection has to
+     * move them to make room). A name index table already in the image is
+     * rebuilt.
+     */
+    bool update(const std::vector<SourceFile>& files);
+
+    /**
+     * @brief Add or replace one file with contents from memory.
+     */
+    bool writeFile(const std::string& name, const uint8_t* data, size_t size, time_t mtime);
+
+    bool list(std::vector<FileInfo>& files);
+    bool stat(const std::string& name, FileInfo& info);
+    bool readFile(const std::string& name, std::vector<uint8_t>& data);
+
+    /**
+     * @brief Hash the contents of files of the image, read through SPIFFS_read.
+     * @param files Files as list() returns them; directories get HASH_INIT.
+     * @param hashes Set to the hashUpdate() hash of each file, in the order of files.
+     * @param chunkSize Bytes asked for per SPIFFS_read call.
+     */
+    bool hashFiles(const std::vector<FileInfo>& files, std::vector<uint64_t>& hashes, size_t chunkSize = 1024 * 1024);
+
+    /**
+     * @brief Extract all files below a host directory, creating it if needed.
+     * @param jobs Number of files extracted at a time, 0 means one per CPU core.
+     *
+     * The image is listed and the directory tree is created once; then every
+     * worker thread reads file contents through its own read-only spiffs
+     * instance over the same flash buffer.
+     */
+    bool unpack(const std::string& destDir, unsigned jobs = 1);
+
+    /**
+     * @brief Print a map of every page (free '_', deleted '/', index 'i', data 'd'),
+     *        the erase count of every block and the usage totals.
+     */
+    bool visualize(std::ostream& out);
+
+#if SPIFFS_NAME_INDEX
+    /**
+     * @brief Write the table of name hashes and object index header pages
+     *        that spiffs mounted with SPIFFS_NAME_INDEX opens files through.
+     *
+     * The table is the file SPIFFS_NAME_INDEX_FILE. It is rewritten until
+     * writing it no longer moves any object it lists.
+     */
+    bool writeNameIndex();
+#endif
+
+    /**
+     * @brief Report page usage and wear per block, layout per file and
+     *        where the flash space goes, reading the lookup and page
+     *        headers directly.
+     */
+    bool analyze(Analysis& analysis);
+
+    /**
+     * @brief Open every file by name and read it to the end, on a freshly
+     *        mounted instance, as firmware reading its assets after boot would.
+     * @param chunkSize Bytes asked for per SPIFFS_read call.
+     *
+     * The flash reads this takes, mount excluded, are left in readOps() and
+     * readBytes().
+     */
+    bool readAll(size_t chunkSize = 4096);
+
+    /**
+     * @brief Count the flash reads of mounting the image, then of opening
+     *        every file by name and reading it to the end, then of a stat
+     *        of every file by name on a fresh mount.
+     * @param chunkSize Bytes asked for per SPIFFS_read call.
+     */
+    bool simulate(Simulation& simulation, size_t chunkSize = 4096);
+
+    /**
+     * @brief Find the largest file that can still be written to the image
+     *        through the spiffs API, garbage collection included.
+     *
+     * Candidate sizes are tried on a scratch copy, so the answer is exact
+     * for this image, which is left untouched. 0 if not even an empty
+     * file fits.
+     */
+    bool largestNewFile(size_t* size);
+
+    /**
+     * @brief Mount the image and run the spiffs consistency check.
+     * @return True if the image mounts and the check finds nothing to fix.
+     */
+    bool check();
+
+    /**
+     * @brief Send progress messages to log and errors to err; both may be NULL.
+     *        A debugLevel above 0 adds per-file sizes and throughput.
+     */
+    void setLog(std::ostream* log, std::ostream* err, int debugLevel = 0);
+    void setDirectLayout(bool direct) { m_directLayout = direct; }
+    void setCompareHash(bool compareHash) { m_compareHash = compareHash; }
+    void setSourceCache(SourceCache* cache) { m_sourceCache = cache; }
+    void setNameIndex(bool nameIndex) { m_nameIndex = nameIndex; }
+
+    /**
+     * @brief Erase counts pack() stamps into the blocks once the files are
+     *        written, in place of those formatting left; empty for none.
+     */
+    void setEraseCounts(const std::vector<spiffs_obj_id>& counts) { m_eraseCounts = counts; }
+
+    const std::string& error() const { return m_error; }
+
+    // Totals of the files written so far, for throughput reports
+    size_t importedBytes() const { return m_importedBytes; }
+    double importSeconds() const { return m_importSeconds; }
+
+    // Flash reads done by spiffs through the HAL since the last reset
+    size_t readOps() const { return m_readOps; }
+    size_t readBytes() const { return m_readBytes; }
+    void resetReadCount() { m_readOps = 0; m_readBytes = 0; }
+
+private:
+    Image(const Image&);
+    Image& operator=(const Image&);
+
+    struct Source;
+    struct Layout;
+
+    s32_t tryMount();
+    bool mount();
+    bool format();
+    void unmount();
+    bool fail(const std::string& message);
+    bool failSpiffs(const char* call);
+    void updateMeta(spiffs_file fd, u8_t type, time_t mtime);
+    bool sourceOpen(const SourceFile& file, Source& src);
+    size_t sourceRead(Source& src, uint8_t* dst, size_t len);
+    void sourceClose(Source& src);
+    bool addFile(const SourceFile& file);
+    bool writeObject(const std::string& name, time_t mtime, Source& src);
+    bool addDir(const SourceFile& file);
+    bool fileUnchanged(const SourceFile& file, const FileInfo& info);
+    bool hashSource(const SourceFile& file, uint64_t* hash);
+    bool hashFile(const std::string& name, uint64_t* hash);
+    bool stampEraseCounts();
+    bool layoutFiles(const std::vector<SourceFile>& files);
+    bool layoutAllocPage(Layout& layout, spiffs_obj_id luId, spiffs_page_ix* pix);
+    bool layoutFile(Layout& layout, const SourceFile& file);
+    bool unpackFile(const FileInfo& info, const std::string& destPath);
+    void borrow(const Image& other);
+
+    static s32_t halRead(spiffs* fs, u32_t addr, u32_t size, u8_t* dst);
+    static s32_t halWrite(spiffs* fs, u32_t addr, u32_t size, u8_t* src);
+    static s32_t halErase(spiffs* fs, u32_t addr, u32_t size);
+    static void checkReport(spiffs* fs, spiffs_check_type type, spiffs_check_report report, u32_t arg1, u32_t arg2);
+
+    size_t m_size;
+    size_t m_pageSize;
+    size_t m_blockSize;
+
+    // Flash contents the HAL callbacks operate on
+    uint8_t* m_flashmem;
+    bool m_flashmemMapped;
+    bool m_flashmemBorrowed;    // belongs to another Image
+    int m_flashmemFd;
+    std::string m_path;
+    bool m_writeBack;
+
+    spiffs m_fs;
+    std::vector<uint8_t> m_workBuf;
+    std::vector<uint8_t> m_fds;
+    std::vector<uint8_t> m_cache;
+
+    bool m_directLayout;
+    bool m_compareHash;
+    bool m_nameIndex;
+    std::vector<spiffs_obj_id> m_eraseCounts;
+    SourceCache* m_sourceCache;
+    std::ostream* m_log;
+    std::ostream* m_err;
+    int m_debugLevel;
+    std::string m_error;
+    int m_checkIssues;
+    size_t m_importedBytes;
+    double m_importSeconds;
+    size_t m_readOps;
+    size_t m_readBytes;
+};
+
+} // namespace mkspiffs
+
+#endif // SPIFFS_IMAGE_H
@@ -59,6 +59,18 @@ typedef struct {
     uint32_t fds_sz;                        /*!< File Descriptor Buffer Length */
     uint8_t *cache;                         /*!< Cache Buffer */
     uint32_t cache_sz;                      /*!< Cache Buffer Length */
+#if SPIFFS_LU_SHADOW
+    uint8_t *lu_shadow;                     /*!< Object Lookup Shadow Buffer */
+#endif
+#if SPIFFS_NAME_HASH
+    uint8_t *name_hash;                     /*!< Name Hash Table Buffer */
+#endif
+#if SPIFFS_FREE_COUNTS
+    uint8_t *free_counts;                   /*!< Free Page Counts Buffer */
+#endif
+#if SPIFFS_OBJ_ID_MAP
+    uint8_t *obj_id_map;                    /*!< Object Id Map Buffer */
+#endif
 } esp_spiffs_t;
 
 /**
@@ -217,9 +229,73 @@ static void esp_spiffs_free(esp_spiffs_t ** efs)
     free(e->fds);
     free(e->cache);
     free(e->work);
+#if SPIFFS_LU_SHADOW
+    free(e->lu_shadow);
+#endif
+#if SPIFFS_NAME_HASH
+    free(e->name_hash);
+#endif
+#if SPIFFS_FREE_COUNTS
+    free(e->free_counts);
+#endif
+#if SPIFFS_OBJ_ID_MAP
+    free(e->obj_id_map);
+#endif
     free(e);
 }
 
+static void esp_spiffs_attach_ram_tables(esp_spiffs_t * efs)
+{
+#if SPIFFS_LU_SHADOW
+    u32_t size = SPIFFS_lu_shadow_bytes(efs->fs);
+    if (efs->lu_shadow == NULL) {
+        efs->lu_shadow = malloc(size);
+    }
+    if (efs->lu_shadow == NULL) {
+        ESP_LOGW(TAG, "lookup shadow could not be malloced, continuing without");
+    } else if (SPIFFS_lu_shadow(efs->fs, efs->lu_shadow, size) != SPIFFS_OK) {
+        ESP_LOGW(TAG, "lookup shadow could not be loaded, %i", SPIFFS_errno(efs->fs));
+        SPIFFS_clearerr(efs->fs);
+    }
+#endif
+#if SPIFFS_NAME_HASH
+    u32_t hash_size = SPIFFS_name_hash_bytes(efs->fs, CONFIG_SPIFFS_NAME_HASH_FILES);
+    if (efs->name_hash == NULL) {
+        efs->name_hash = malloc(hash_size);
+    }
+    if (efs->name_hash == NULL) {
+        ESP_LOGW(TAG, "name hash table could not be malloced, continuing without");
+    } else if (SPIFFS_name_hash(efs->fs, efs->name_hash, hash_size) != SPIFFS_OK) {
+        ESP_LOGW(TAG, "name hash table could not be built, %i", SPIFFS_errno(efs->fs));
+        SPIFFS_clearerr(efs->fs);
+    }
+#endif
+#if SPIFFS_FREE_COUNTS
+    u32_t counts_size = SPIFFS_free_counts_bytes(efs->fs);
+    if (efs->free_counts == NULL) {
+        efs->free_counts = malloc(counts_size);
+    }
+    if (efs->free_counts == NULL) {
+        ESP_LOGW(TAG, "free page counts could not be malloced, continuing without");
+    } else if (SPIFFS_free_counts(efs->fs, efs->free_counts, counts_size) != SPIFFS_OK) {
+        ESP_LOGW(TAG, "free page counts could not be built, %i", SPIFFS_errno(efs->fs));
+        SPIFFS_clearerr(efs->fs);
+    }
+#endif
+#if SPIFFS_OBJ_ID_MAP
+    u32_t map_size = SPIFFS_obj_id_map_bytes(efs->fs);
+    if (efs->obj_id_map == NULL) {
+        efs->obj_id_map = malloc(map_size);
+    }
+    if (efs->obj_id_map == NULL) {
+        ESP_LOGW(TAG, "object id map could not be malloced, continuing without");
+    } else if (SPIFFS_obj_id_map(efs->fs, efs->obj_id_map, map_size) != SPIFFS_OK) {
+        ESP_LOGW(TAG, "object id map could not be built, %i", SPIFFS_errno(efs->fs));
+        SPIFFS_clearerr(efs->fs);
+    }
+#endif
+}
+
 static esp_err_t esp_spiffs_by_label(const char* label, int * index){
     int i;
     esp_spiffs_t * p;
@@ -373,6 +449,7 @@ static esp_err_t esp_spiffs_init(const esp_vfs_spiffs_conf_t* conf)
         esp_spiffs_free(&efs);
         return ESP_FAIL;
     }
+    esp_spiffs_attach_ram_tables(efs);
     _efs[index] = efs;
     return ESP_OK;
 }
@@ -446,6 +523,7 @@ esp_err_t esp_spiffs_format(const char* partition_label)
             SPIFFS_clearerr(_efs[index]->fs);
             return ESP_FAIL;
         }
+        esp_spiffs_attach_ram_tables(_efs[index]);
     } else {
         esp_spiffs_free(&_efs[index]);
     }
@@ -271,6 +271,74 @@ _Static_assert(SPIFFS_OBJ_META_LEN + SPIFFS_OBJ_NAME_LEN + SPIFFS_PAGE_EXTRA_SIZ
 // descriptor.
 #define SPIFFS_IX_MAP                           1
 
+// Enable this to look names up in a name index table, if the image has one.
+// An image builder can store a table of object name hashes and index header
+// pages, sorted by hash, as the file SPIFFS_NAME_INDEX_FILE. It is detected
+// at mount and from then on opening a file takes a binary search of the table
+// instead of a scan of the object lookup pages. Every hit is checked against
+// the object index header, and names not found in the table are still looked
+// up by scanning, so a table gone stale after files were changed only costs
+// speed. Meant for read-only partitions built on the host.
+#ifdef CONFIG_SPIFFS_NAME_INDEX
+#define SPIFFS_NAME_INDEX                       1
+#else
+#define SPIFFS_NAME_INDEX                       0
+#endif
+// Name of the file holding the name index table
+#define SPIFFS_NAME_INDEX_FILE                  "/.spiffs_name_index"
+
+// Enable this to allow keeping a copy of all object lookup pages in RAM, see
+// SPIFFS_lu_shadow. The copy takes two bytes per page of the file system and
+// is updated on every lookup entry write, so that the scans behind opening,
+// stat'ing, allocating pages and garbage collecting no longer read the object
+// lookup pages from flash.
+#ifdef CONFIG_SPIFFS_LU_SHADOW
+#define SPIFFS_LU_SHADOW                        1
+#else
+#define SPIFFS_LU_SHADOW                        0
+#endif
+
+// Enable this to allow keeping a hash table of all file names in RAM, see
+// SPIFFS_name_hash. With it, looking up a name takes a read of the object
+// index header of the one or few files with the same name hash, and a name
+// that doesn't exist takes none, instead of a scan of the file system.
+#ifdef CONFIG_SPIFFS_NAME_HASH
+#define SPIFFS_NAME_HASH                        1
+#else
+#define SPIFFS_NAME_HASH                        0
+#endif
+
+// Enable this to allow keeping a count of free pages per block in RAM, see
+// SPIFFS_free_counts. With it, finding a free page skips full blocks instead
+// of reading their object lookup pages.
+#ifdef CONFIG_SPIFFS_FREE_COUNTS
+#define SPIFFS_FREE_COUNTS                      1
+#else
+#define SPIFFS_FREE_COUNTS                      0
+#endif
+
+// Enable this to allow keeping a bitmap of the object ids in use in RAM, see
+// SPIFFS_obj_id_map. With it, creating a file takes a free object id without
+// scanning the file system; with SPIFFS_NAME_HASH as well, so does the check
+// for a conflicting name.
+#ifdef CONFIG_SPIFFS_OBJ_ID_MAP
+#define SPIFFS_OBJ_ID_MAP                       1
+#else
+#define SPIFFS_OBJ_ID_MAP                       0
+#endif
+
+// Enable this to write a summary of the file system to a page on unmount,
+// which the next mount reads instead of scanning all object lookup pages. The
+// page is deleted before the file system is first written to after mounting.
+// Writers built without this leave the page alone; mount scans if one has
+// allocated after it, and garbage collection counts again before trusting
+// the counters, as pages they deleted only show in the object lookup.
+#ifdef CONFIG_SPIFFS_SUMMARY
+#define SPIFFS_SUMMARY                          1
+#else
+#define SPIFFS_SUMMARY                          0
+#endif
+
 // Set SPIFFS_TEST_VISUALISATION to non-zero to enable SPIFFS_vis function
 // in the api. This function will visualize all filesystem using given printf
 // function.
@@ -62,6 +62,11 @@ extern "C" {
 
 #define SPIFFS_ERR_SEEK_BOUNDS          -10040
 
+#define SPIFFS_ERR_LU_SHADOW_SIZE       -10041
+#define SPIFFS_ERR_NAME_HASH_FULL       -10042
+#define SPIFFS_ERR_FREE_COUNTS_SIZE     -10043
+#define SPIFFS_ERR_OBJ_ID_MAP_SIZE      -10044
+
 
 #define SPIFFS_ERR_INTERNAL             -10050
 
@@ -266,6 +271,49 @@ typedef struct spiffs_t {
   // max erase count amongst all blocks
   spiffs_obj_id max_erase_count;
 
+#if SPIFFS_NAME_INDEX
+  // object index header page of the name index table
+  spiffs_page_ix name_index_pix;
+  // object id of the name index table
+  spiffs_obj_id name_index_obj_id;
+  // number of entries in the name index table, 0 if there is none
+  u32_t name_index_count;
+#endif
+
+#if SPIFFS_LU_SHADOW
+  // RAM copy of the object lookup entries of all blocks, 0 if there is none
+  spiffs_obj_id *lu_shadow;
+#endif
+
+#if SPIFFS_FREE_COUNTS
+  // number of free pages at the end of each block, 0 if not counted
+  spiffs_page_ix *free_counts;
+#endif
+
+#if SPIFFS_SUMMARY
+  // summary page this file system was mounted from, deleted before anything
+  // is written; 0 if none
+  spiffs_page_ix summary_pix;
+  // sequence number of the last summary
+  u32_t summary_seq;
+  // set while the block counters are the ones taken from a summary
+  u8_t summary_counts;
+#endif
+
+#if SPIFFS_OBJ_ID_MAP
+  // bitmap of object ids in use, 0 if there is none
+  u8_t *obj_id_map;
+#endif
+
+#if SPIFFS_NAME_HASH
+  // name hash table, 0 if there is none
+  void *name_hash;
+  // number of slots in the name hash table
+  u32_t name_hash_slots;
+  // number of used slots in the name hash table
+  u32_t name_hash_count;
+#endif
+
 #if SPIFFS_GC_STATS
   u32_t stats_gc_runs;
 #endif
@@ -791,6 +839,112 @@ s32_t SPIFFS_ix_map_entries_to_bytes(spiffs *fs, u32_t map_page_ix_entries);
 s32_t SPIFFS_vis(spiffs *fs);
 #endif
 
+#if SPIFFS_LU_SHADOW
+/**
+ * Returns number of bytes needed for a lookup shadow of a mounted file system,
+ * that is two bytes per page. See SPIFFS_lu_shadow.
+ * @param fs            the file system struct
+ */
+u32_t SPIFFS_lu_shadow_bytes(spiffs *fs);
+
+/**
+ * Keeps a copy of all object lookup pages in RAM. Until the file system is
+ * unmounted, every lookup entry write also goes to the copy and scans of the
+ * lookup pages, done by open, stat, page allocation and the garbage
+ * collector, no longer read from flash.
+ * Must be called after mounting. The buffer is filled from flash and must be
+ * left alone by the caller until SPIFFS_unmount, or until this function is
+ * called again with a null buffer, which drops the copy.
+ * @param fs            the file system struct
+ * @param buf           buffer of at least SPIFFS_lu_shadow_bytes bytes, aligned
+ *                      for spiffs_obj_id, or 0
+ * @param size          size of buf
+ */
+s32_t SPIFFS_lu_shadow(spiffs *fs, void *buf, u32_t size);
+#endif
+
+#if SPIFFS_FREE_COUNTS
+/**
+ * Returns number of bytes needed for free page counts of a mounted file
+ * system, one spiffs_page_ix per block. See SPIFFS_free_counts.
+ * @param fs            the file system struct
+ */
+u32_t SPIFFS_free_counts_bytes(spiffs *fs);
+
+/**
+ * Keeps a count of free pages per block in RAM. Until the file system is
+ * unmounted, the counts are kept current as pages are allocated and blocks
+ * are erased, and finding a free page for writing takes it from the counts
+ * without reading any object lookup pages. This keeps appending cheap on a
+ * nearly full file system. Free pages followed by used ones in their block,
+ * as left by a failed write, are not counted until the block is erased.
+ * Must be called after mounting. The counts are built by one pass over the
+ * object lookup pages. The buffer must be left alone by the caller until
+ * SPIFFS_unmount, or until this function is called again with a null buffer,
+ * which drops the counts.
+ * @param fs            the file system struct
+ * @param buf           buffer of at least SPIFFS_free_counts_bytes bytes,
+ *                      aligned for spiffs_page_ix, or 0
+ * @param size          size of buf
+ */
+s32_t SPIFFS_free_counts(spiffs *fs, void *buf, u32_t size);
+#endif
+
+#if SPIFFS_OBJ_ID_MAP
+/**
+ * Returns number of bytes needed for the object id map of a mounted file
+ * system, one bit per possible object id. See SPIFFS_obj_id_map.
+ * @param fs            the file system struct
+ */
+u32_t SPIFFS_obj_id_map_bytes(spiffs *fs);
+
+/**
+ * Keeps a bitmap of the object ids in use in RAM. Until the file system is
+ * unmounted, the map is kept current as files are created and removed, and
+ * creating a file takes the lowest free id from it instead of scanning all
+ * object lookup pages, and object index headers, for ids in use.
+ * Names are still checked for conflicts on SPIFFS_creat, by a name lookup;
+ * with SPIFFS_name_hash also attached, that lookup needs no scan either.
+ * Must be called after mounting. The map is built by one pass over the
+ * object lookup pages. The buffer must be left alone by the caller until
+ * SPIFFS_unmount, or until this function is called again with a null buffer,
+ * which drops the map.
+ * @param fs            the file system struct
+ * @param buf           buffer of at least SPIFFS_obj_id_map_bytes bytes, or 0
+ * @param size          size of buf
+ */
+s32_t SPIFFS_obj_id_map(spiffs *fs, void *buf, u32_t size);
+#endif
+
+#if SPIFFS_NAME_HASH
+/**
+ * Returns number of bytes needed for a name hash table holding given amount
+ * of files. See SPIFFS_name_hash.
+ * @param fs            the file system struct
+ * @param num_files     number of files the table must hold
+ */
+u32_t SPIFFS_name_hash_bytes(spiffs *fs, u32_t num_files);
+
+/**
+ * Keeps a hash table of all file names in RAM. Until the file system is
+ * unmounted, the table is kept current as files are created, renamed and
+ * removed, and looking up a name when opening, stat'ing, renaming or
+ * removing a file takes a read of the object index header of each file with
+ * the same name hash, usually one, instead of a scan of the file system.
+ * Must be called after mounting. The table is built by one scan of the file
+ * system; if it holds more files than the buffer was sized for, the call
+ * fails with SPIFFS_ERR_NAME_HASH_FULL. Should later file creations overflow
+ * the table, it is dropped and names are looked up by scanning again.
+ * The buffer must be left alone by the caller until SPIFFS_unmount, or until
+ * this function is called again with a null buffer, which drops the table.
+ * @param fs            the file system struct
+ * @param buf           buffer of SPIFFS_name_hash_bytes bytes, aligned for
+ *                      u32_t, or 0
+ * @param size          size of buf
+ */
+s32_t SPIFFS_name_hash(spiffs *fs, void *buf, u32_t size);
+#endif
+
 #if SPIFFS_BUFFER_HELP
 /**
  * Returns number of bytes needed for the filedescriptor buffer given
@@ -34,7 +34,6 @@ s32_t spiffs_gc_quick(
   s32_t res = SPIFFS_OK;
   u32_t blocks = fs->block_count;
   spiffs_block_ix cur_block = 0;
-  u32_t cur_block_addr = 0;
   int cur_entry = 0;
   spiffs_obj_id *obj_lu_buf = (spiffs_obj_id *)fs->lu_work;
 
@@ -55,8 +54,7 @@ s32_t spiffs_gc_quick(
     // check each object lookup page
     while (res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
       int entry_offset = obj_lookup_page * entries_per_page;
-      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-          0, cur_block_addr + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+      res = spiffs_obj_lu_page_read(fs, cur_block, obj_lookup_page);
       // check each entry
       while (res == SPIFFS_OK &&
           cur_entry - entry_offset < entries_per_page &&
@@ -95,7 +93,6 @@ s32_t spiffs_gc_quick(
 
     cur_entry = 0;
     cur_block++;
-    cur_block_addr += SPIFFS_CFG_LOG_BLOCK_SZ(fs);
   } // per block
 
   if (res == SPIFFS_OK) {
@@ -120,6 +117,18 @@ s32_t spiffs_gc_check(
     return SPIFFS_OK;
   }
 
+#if SPIFFS_SUMMARY
+  if (fs->summary_counts) {
+    // pages deleted by a writer that leaves the summary alone show nowhere
+    // but in the object lookup, so count again before deciding on them
+    res = spiffs_obj_lu_scan(fs);
+    SPIFFS_CHECK_RES(res);
+    free_pages =
+        (SPIFFS_PAGES_PER_BLOCK(fs) - SPIFFS_OBJ_LOOKUP_PAGES(fs)) * (fs->block_count-2)
+        - fs->stats_p_allocated - fs->stats_p_deleted;
+  }
+#endif
+
   u32_t needed_pages = (len + SPIFFS_DATA_PAGE_SIZE(fs) - 1) / SPIFFS_DATA_PAGE_SIZE(fs);
 //  if (fs->free_blocks <= 2 && (s32_t)needed_pages > free_pages) {
 //    SPIFFS_GC_DBG("gc: full freeblk:"_SPIPRIi" needed:"_SPIPRIi" free:"_SPIPRIi" dele:"_SPIPRIi"\n", fs->free_blocks, needed_pages, free_pages, fs->stats_p_deleted);
@@ -210,8 +219,7 @@ s32_t spiffs_gc_erase_page_stats(
   // check each object lookup page
   while (res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
     int entry_offset = obj_lookup_page * entries_per_page;
-    res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-        0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+    res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
     // check each entry
     while (res == SPIFFS_OK &&
         cur_entry - entry_offset < entries_per_page && cur_entry < (int)(SPIFFS_PAGES_PER_BLOCK(fs)-SPIFFS_OBJ_LOOKUP_PAGES(fs))) {
@@ -241,7 +249,6 @@ s32_t spiffs_gc_find_candidate(
   s32_t res = SPIFFS_OK;
   u32_t blocks = fs->block_count;
   spiffs_block_ix cur_block = 0;
-  u32_t cur_block_addr = 0;
   spiffs_obj_id *obj_lu_buf = (spiffs_obj_id *)fs->lu_work;
   int cur_entry = 0;
 
@@ -270,8 +277,7 @@ s32_t spiffs_gc_find_candidate(
     // check each object lookup page
     while (res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
       int entry_offset = obj_lookup_page * entries_per_page;
-      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-          0, cur_block_addr + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+      res = spiffs_obj_lu_page_read(fs, cur_block, obj_lookup_page);
       // check each entry
       while (res == SPIFFS_OK &&
           cur_entry - entry_offset < entries_per_page &&
@@ -338,7 +344,6 @@ s32_t spiffs_gc_find_candidate(
 
     cur_entry = 0;
     cur_block++;
-    cur_block_addr += SPIFFS_CFG_LOG_BLOCK_SZ(fs);
   } // per block
 
   return res;
@@ -387,6 +392,12 @@ s32_t spiffs_gc_clean(spiffs *fs, spiffs_block_ix bix) {
 
   SPIFFS_GC_DBG("gc_clean: cleaning block "_SPIPRIbl"\n", bix);
 
+#if SPIFFS_SUMMARY
+  // before the object lookup is read, as deleting the summary page writes to it
+  res = spiffs_summary_invalidate(fs);
+  SPIFFS_CHECK_RES(res);
+#endif
+
   memset(&gc, 0, sizeof(spiffs_gc));
   gc.state = FIND_OBJ_DATA;
 
@@ -407,9 +418,7 @@ s32_t spiffs_gc_clean(spiffs *fs, spiffs_block_ix bix) {
     // check each object lookup page
     while (scan && res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
       int entry_offset = obj_lookup_page * entries_per_page;
-      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-          0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page),
-          SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+      res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
       // check each object lookup entry
       while (scan && res == SPIFFS_OK &&
           cur_entry - entry_offset < entries_per_page && cur_entry < (int)(SPIFFS_PAGES_PER_BLOCK(fs)-SPIFFS_OBJ_LOOKUP_PAGES(fs))) {
@@ -449,9 +458,7 @@ s32_t spiffs_gc_clean(spiffs *fs, spiffs_block_ix bix) {
                 SPIFFS_GC_DBG("gc_clean: MOVE_DATA move objix "_SPIPRIid":"_SPIPRIsp" page "_SPIPRIpg" to "_SPIPRIpg"\n", gc.cur_obj_id, p_hdr.span_ix, cur_pix, new_data_pix);
                 SPIFFS_CHECK_RES(res);
                 // move wipes obj_lu, reload it
-                res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-                    0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page),
-                    SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+                res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
                 SPIFFS_CHECK_RES(res);
               } else {
                 // page is deleted but not deleted in lookup, scrap it -
@@ -494,9 +501,7 @@ s32_t spiffs_gc_clean(spiffs *fs, spiffs_block_ix bix) {
               spiffs_cb_object_event(fs, (spiffs_page_object_ix *)&p_hdr,
                   SPIFFS_EV_IX_MOV, obj_id, p_hdr.span_ix, new_pix, 0);
               // move wipes obj_lu, reload it
-              res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-                  0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page),
-                  SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+              res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
               SPIFFS_CHECK_RES(res);
             } else {
               // page is deleted but not deleted in lookup, scrap it -
@@ -131,7 +131,11 @@ s32_t SPIFFS_mount(spiffs *fs, spiffs_config *config, u8_t *work,
 
   fs->config_magic = SPIFFS_CONFIG_MAGIC;
 
+#if SPIFFS_SUMMARY
+  res = spiffs_summary_load(fs);
+#else
   res = spiffs_obj_lu_scan(fs);
+#endif
   SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
 
   SPIFFS_DBG("page index byte len:         "_SPIPRIi"\n", (u32_t)SPIFFS_CFG_LOG_PAGE_SZ(fs));
@@ -145,6 +149,11 @@ s32_t SPIFFS_mount(spiffs *fs, spiffs_config *config, u8_t *work,
 
   fs->check_cb_f = check_cb_f;
 
+#if SPIFFS_NAME_INDEX
+  // the table only speeds up lookups, mount without it if it can't be read
+  (void)spiffs_name_index_load(fs);
+#endif
+
   fs->mounted = 1;
 
   SPIFFS_UNLOCK(fs);
@@ -167,7 +176,26 @@ void SPIFFS_unmount(spiffs *fs) {
       spiffs_fd_return(fs, cur_fd->file_nbr);
     }
   }
+#if SPIFFS_SUMMARY && !SPIFFS_READ_ONLY
+  // if it can't be written, the next mount scans
+  (void)spiffs_summary_write(fs);
+#endif
   fs->mounted = 0;
+#if SPIFFS_SUMMARY
+  fs->summary_pix = 0;
+#endif
+#if SPIFFS_LU_SHADOW
+  fs->lu_shadow = 0;
+#endif
+#if SPIFFS_NAME_HASH
+  fs->name_hash = 0;
+#endif
+#if SPIFFS_FREE_COUNTS
+  fs->free_counts = 0;
+#endif
+#if SPIFFS_OBJ_ID_MAP
+  fs->obj_id_map = 0;
+#endif
 
   SPIFFS_UNLOCK(fs);
 }
@@ -1107,6 +1135,12 @@ s32_t SPIFFS_check(spiffs *fs) {
   SPIFFS_API_CHECK_MOUNT(fs);
   SPIFFS_LOCK(fs);
 
+#if SPIFFS_SUMMARY
+  // or the checks would find the summary page, which belongs to no object
+  res = spiffs_summary_invalidate(fs);
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+#endif
+
   res = spiffs_lookup_consistency_check(fs, 0);
 
   res = spiffs_object_index_consistency_check(fs);
@@ -1115,6 +1149,25 @@ s32_t SPIFFS_check(spiffs *fs) {
 
   res = spiffs_obj_lu_scan(fs);
 
+#if SPIFFS_FREE_COUNTS
+  // repairs may take free pages
+  if (res == SPIFFS_OK && fs->free_counts && spiffs_free_counts_build(fs) != SPIFFS_OK) {
+    fs->free_counts = 0;
+  }
+#endif
+#if SPIFFS_OBJ_ID_MAP
+  // repairs may delete objects
+  if (res == SPIFFS_OK && fs->obj_id_map && spiffs_obj_id_map_build(fs) != SPIFFS_OK) {
+    fs->obj_id_map = 0;
+  }
+#endif
+#if SPIFFS_NAME_HASH
+  // repairs bypass object events
+  if (res == SPIFFS_OK && fs->name_hash && spiffs_name_hash_build(fs) != SPIFFS_OK) {
+    fs->name_hash = 0;
+  }
+#endif
+
   SPIFFS_UNLOCK(fs);
   return res;
 #endif // SPIFFS_READ_ONLY
@@ -1240,6 +1293,122 @@ s32_t SPIFFS_set_file_callback_func(spiffs *fs, spiffs_file_callback cb_func) {
   return 0;
 }
 
+#if SPIFFS_LU_SHADOW
+u32_t SPIFFS_lu_shadow_bytes(spiffs *fs) {
+  return fs->block_count * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) * sizeof(spiffs_obj_id);
+}
+
+s32_t SPIFFS_lu_shadow(spiffs *fs, void *buf, u32_t size) {
+  SPIFFS_API_DBG("%s "_SPIPRIi "\n", __func__, size);
+  s32_t res = SPIFFS_OK;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  SPIFFS_LOCK(fs);
+  if (buf == 0) {
+    fs->lu_shadow = 0;
+  } else {
+    if (size < SPIFFS_lu_shadow_bytes(fs)) {
+      res = SPIFFS_ERR_LU_SHADOW_SIZE;
+    } else {
+      res = spiffs_lu_shadow_load(fs, (spiffs_obj_id *)buf);
+    }
+  }
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+  SPIFFS_UNLOCK(fs);
+  return res;
+}
+#endif
+
+#if SPIFFS_FREE_COUNTS
+u32_t SPIFFS_free_counts_bytes(spiffs *fs) {
+  return fs->block_count * sizeof(spiffs_page_ix);
+}
+
+s32_t SPIFFS_free_counts(spiffs *fs, void *buf, u32_t size) {
+  SPIFFS_API_DBG("%s "_SPIPRIi "\n", __func__, size);
+  s32_t res = SPIFFS_OK;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  SPIFFS_LOCK(fs);
+  fs->free_counts = 0;
+  if (buf) {
+    if (size < SPIFFS_free_counts_bytes(fs)) {
+      res = SPIFFS_ERR_FREE_COUNTS_SIZE;
+    } else {
+      fs->free_counts = (spiffs_page_ix *)buf;
+      res = spiffs_free_counts_build(fs);
+      if (res != SPIFFS_OK) {
+        fs->free_counts = 0;
+      }
+    }
+  }
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+  SPIFFS_UNLOCK(fs);
+  return res;
+}
+#endif
+
+#if SPIFFS_OBJ_ID_MAP
+u32_t SPIFFS_obj_id_map_bytes(spiffs *fs) {
+  return (SPIFFS_OBJ_ID_MAP_IDS(fs) + 7) / 8;
+}
+
+s32_t SPIFFS_obj_id_map(spiffs *fs, void *buf, u32_t size) {
+  SPIFFS_API_DBG("%s "_SPIPRIi "\n", __func__, size);
+  s32_t res = SPIFFS_OK;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  SPIFFS_LOCK(fs);
+  fs->obj_id_map = 0;
+  if (buf) {
+    if (size < SPIFFS_obj_id_map_bytes(fs)) {
+      res = SPIFFS_ERR_OBJ_ID_MAP_SIZE;
+    } else {
+      fs->obj_id_map = (u8_t *)buf;
+      res = spiffs_obj_id_map_build(fs);
+      if (res != SPIFFS_OK) {
+        fs->obj_id_map = 0;
+      }
+    }
+  }
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+  SPIFFS_UNLOCK(fs);
+  return res;
+}
+#endif
+
+#if SPIFFS_NAME_HASH
+u32_t SPIFFS_name_hash_bytes(spiffs *fs, u32_t num_files) {
+  (void)fs;
+  // at most three quarters of the slots are used, keeping probe runs short
+  return (num_files + num_files / 3 + 2) * sizeof(spiffs_name_hash_entry);
+}
+
+s32_t SPIFFS_name_hash(spiffs *fs, void *buf, u32_t size) {
+  SPIFFS_API_DBG("%s "_SPIPRIi "\n", __func__, size);
+  s32_t res = SPIFFS_OK;
+  SPIFFS_API_CHECK_CFG(fs);
+  SPIFFS_API_CHECK_MOUNT(fs);
+  SPIFFS_LOCK(fs);
+  fs->name_hash = 0;
+  if (buf) {
+    fs->name_hash_slots = size / sizeof(spiffs_name_hash_entry);
+    if (fs->name_hash_slots < 2) {
+      res = SPIFFS_ERR_NAME_HASH_FULL;
+    } else {
+      fs->name_hash = buf;
+      res = spiffs_name_hash_build(fs);
+      if (res != SPIFFS_OK) {
+        fs->name_hash = 0;
+      }
+    }
+  }
+  SPIFFS_API_CHECK_RES_UNLOCK(fs, res);
+  SPIFFS_UNLOCK(fs);
+  return res;
+}
+#endif
+
 #if SPIFFS_IX_MAP
 
 s32_t SPIFFS_ix_map(spiffs *fs,  spiffs_file fh, spiffs_ix_map *map,
@@ -1393,8 +1562,7 @@ s32_t SPIFFS_vis(spiffs *fs) {
 
     while (res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
       int entry_offset = obj_lookup_page * entries_per_page;
-      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-          0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+      res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
       // check each entry
       while (res == SPIFFS_OK &&
           cur_entry - entry_offset < entries_per_page && cur_entry < (int)(SPIFFS_PAGES_PER_BLOCK(fs)-SPIFFS_OBJ_LOOKUP_PAGES(fs))) {
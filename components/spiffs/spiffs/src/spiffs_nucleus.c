@@ -66,6 +66,9 @@ s32_t spiffs_phys_rd(
     u32_t addr,
     u32_t len,
     u8_t *dst) {
+#if SPIFFS_LU_SHADOW
+  if (spiffs_lu_shadow_rd(fs, addr, len, dst)) return SPIFFS_OK;
+#endif
   return SPIFFS_HAL_READ(fs, addr, len, dst);
 }
 
@@ -74,11 +77,102 @@ s32_t spiffs_phys_wr(
     u32_t addr,
     u32_t len,
     u8_t *src) {
-  return SPIFFS_HAL_WRITE(fs, addr, len, src);
+#if SPIFFS_SUMMARY && !SPIFFS_READ_ONLY
+  s32_t res = spiffs_summary_invalidate(fs);
+  SPIFFS_CHECK_RES(res);
+  res = SPIFFS_HAL_WRITE(fs, addr, len, src);
+#else
+  s32_t res = SPIFFS_HAL_WRITE(fs, addr, len, src);
+#endif
+#if SPIFFS_LU_SHADOW
+  if (res == SPIFFS_OK) spiffs_lu_shadow_wr(fs, addr, len, src);
+#endif
+  return res;
+}
+
+#endif
+
+#if SPIFFS_LU_SHADOW
+// Returns the byte offset in the lookup shadow of flash address addr, or -1 if
+// addr is outside of the object lookup entries of its block. If in_entries is
+// given, it is set to the number of entry bytes from addr to the end of the
+// entries of the block.
+static s32_t spiffs_lu_shadow_offset(spiffs *fs, u32_t addr, u32_t *in_entries) {
+  u32_t entries_sz = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) * sizeof(spiffs_obj_id);
+  if (addr < SPIFFS_CFG_PHYS_ADDR(fs)) return -1;
+  u32_t offs = addr - SPIFFS_CFG_PHYS_ADDR(fs);
+  u32_t bix = offs / SPIFFS_CFG_LOG_BLOCK_SZ(fs);
+  u32_t boffs = offs % SPIFFS_CFG_LOG_BLOCK_SZ(fs);
+  if (bix >= fs->block_count || boffs >= entries_sz) return -1;
+  if (in_entries) *in_entries = entries_sz - boffs;
+  return (s32_t)(bix * entries_sz + boffs);
+}
+
+// Serves a read from the lookup shadow. Returns 1 if it lay entirely within
+// object lookup entries and dst was filled, 0 if it has to go to flash.
+u8_t spiffs_lu_shadow_rd(spiffs *fs, u32_t addr, u32_t len, u8_t *dst) {
+  u32_t in_entries;
+  if (fs->lu_shadow == 0) return 0;
+  s32_t offs = spiffs_lu_shadow_offset(fs, addr, &in_entries);
+  if (offs < 0 || len > in_entries) return 0;
+  _SPIFFS_MEMCPY(dst, (u8_t *)fs->lu_shadow + offs, len);
+  return 1;
+}
+
+// Mirrors the part of a flash write that lands in object lookup entries into
+// the lookup shadow.
+void spiffs_lu_shadow_wr(spiffs *fs, u32_t addr, u32_t len, u8_t *src) {
+  u32_t in_entries;
+  if (fs->lu_shadow == 0) return;
+  s32_t offs = spiffs_lu_shadow_offset(fs, addr, &in_entries);
+  if (offs < 0) return;
+  _SPIFFS_MEMCPY((u8_t *)fs->lu_shadow + offs, src, MIN(len, in_entries));
 }
 
+// Fills the lookup shadow from the object lookup pages on flash, one page per
+// read as reads must not cross pages.
+s32_t spiffs_lu_shadow_load(spiffs *fs, spiffs_obj_id *shadow) {
+  s32_t res = SPIFFS_OK;
+  u32_t entries_sz = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) * sizeof(spiffs_obj_id);
+  spiffs_block_ix bix;
+  fs->lu_shadow = 0;
+  for (bix = 0; res == SPIFFS_OK && bix < fs->block_count; bix++) {
+    u32_t offs = 0;
+    while (res == SPIFFS_OK && offs < entries_sz) {
+      u32_t len = MIN(SPIFFS_CFG_LOG_PAGE_SZ(fs), entries_sz - offs);
+      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ, 0,
+          SPIFFS_BLOCK_TO_PADDR(fs, bix) + offs, len, (u8_t *)shadow + bix * entries_sz + offs);
+      offs += len;
+    }
+  }
+  SPIFFS_CHECK_RES(res);
+  fs->lu_shadow = shadow;
+  return res;
+}
 #endif
 
+// Reads object lookup page obj_lookup_page of block bix into fs->lu_work. With
+// a lookup shadow, only the lookup entries are copied, from RAM.
+s32_t spiffs_obj_lu_page_read(
+    spiffs *fs,
+    spiffs_block_ix bix,
+    int obj_lookup_page) {
+#if SPIFFS_LU_SHADOW
+  if (fs->lu_shadow) {
+    u32_t entries_per_page = SPIFFS_CFG_LOG_PAGE_SZ(fs) / sizeof(spiffs_obj_id);
+    u32_t first = obj_lookup_page * entries_per_page;
+    u32_t count = MIN(entries_per_page, SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) - first);
+    _SPIFFS_MEMCPY(fs->lu_work,
+        &fs->lu_shadow[bix * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) + first],
+        count * sizeof(spiffs_obj_id));
+    return SPIFFS_OK;
+  }
+#endif
+  return _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
+      0, bix * SPIFFS_CFG_LOG_BLOCK_SZ(fs) + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page),
+      SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+}
+
 #if !SPIFFS_READ_ONLY
 s32_t spiffs_phys_cpy(
     spiffs *fs,
@@ -135,7 +229,6 @@ s32_t spiffs_obj_lu_find_entry_visitor(
   s32_t res = SPIFFS_OK;
   s32_t entry_count = fs->block_count * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs);
   spiffs_block_ix cur_block = starting_block;
-  u32_t cur_block_addr = starting_block * SPIFFS_CFG_LOG_BLOCK_SZ(fs);
 
   spiffs_obj_id *obj_lu_buf = (spiffs_obj_id *)fs->lu_work;
   int cur_entry = starting_lu_entry;
@@ -145,14 +238,12 @@ s32_t spiffs_obj_lu_find_entry_visitor(
   if (cur_entry > (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) - 1) {
     cur_entry = 0;
     cur_block++;
-    cur_block_addr = cur_block * SPIFFS_CFG_LOG_BLOCK_SZ(fs);
     if (cur_block >= fs->block_count) {
       if (flags & SPIFFS_VIS_NO_WRAP) {
         return SPIFFS_VIS_END;
       } else {
         // block wrap
         cur_block = 0;
-        cur_block_addr = 0;
       }
     }
   }
@@ -163,8 +254,7 @@ s32_t spiffs_obj_lu_find_entry_visitor(
     // check each object lookup page
     while (res == SPIFFS_OK && obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs)) {
       int entry_offset = obj_lookup_page * entries_per_page;
-      res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-          0, cur_block_addr + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+      res = spiffs_obj_lu_page_read(fs, cur_block, obj_lookup_page);
       // check each entry
       while (res == SPIFFS_OK &&
           cur_entry - entry_offset < entries_per_page && // for non-last obj lookup pages
@@ -183,8 +273,7 @@ s32_t spiffs_obj_lu_find_entry_visitor(
                 user_var_p);
             if (res == SPIFFS_VIS_COUNTINUE || res == SPIFFS_VIS_COUNTINUE_RELOAD) {
               if (res == SPIFFS_VIS_COUNTINUE_RELOAD) {
-                res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU | SPIFFS_OP_C_READ,
-                    0, cur_block_addr + SPIFFS_PAGE_TO_PADDR(fs, obj_lookup_page), SPIFFS_CFG_LOG_PAGE_SZ(fs), fs->lu_work);
+                res = spiffs_obj_lu_page_read(fs, cur_block, obj_lookup_page);
                 SPIFFS_CHECK_RES(res);
               }
               res = SPIFFS_OK;
@@ -205,14 +294,12 @@ s32_t spiffs_obj_lu_find_entry_visitor(
     } // per object lookup page
     cur_entry = 0;
     cur_block++;
-    cur_block_addr += SPIFFS_CFG_LOG_BLOCK_SZ(fs);
     if (cur_block >= fs->block_count) {
       if (flags & SPIFFS_VIS_NO_WRAP) {
         return SPIFFS_VIS_END;
       } else {
         // block wrap
         cur_block = 0;
-        cur_block_addr = 0;
       }
     }
   } // per block
@@ -230,6 +317,11 @@ s32_t spiffs_erase_block(
   u32_t addr = SPIFFS_BLOCK_TO_PADDR(fs, bix);
   s32_t size = SPIFFS_CFG_LOG_BLOCK_SZ(fs);
 
+#if SPIFFS_SUMMARY
+  res = spiffs_summary_invalidate(fs);
+  SPIFFS_CHECK_RES(res);
+#endif
+
   // here we ignore res, just try erasing the block
   while (size > 0) {
     SPIFFS_DBG("erase "_SPIPRIad":"_SPIPRIi"\n", addr,  SPIFFS_CFG_PHYS_ERASE_SZ(fs));
@@ -239,6 +331,17 @@ s32_t spiffs_erase_block(
     size -= SPIFFS_CFG_PHYS_ERASE_SZ(fs);
   }
   fs->free_blocks++;
+#if SPIFFS_LU_SHADOW
+  if (fs->lu_shadow) {
+    memset(&fs->lu_shadow[bix * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)], 0xff,
+        SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) * sizeof(spiffs_obj_id));
+  }
+#endif
+#if SPIFFS_FREE_COUNTS
+  if (fs->free_counts) {
+    fs->free_counts[bix] = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs);
+  }
+#endif
 
   // register erase count for this block
   res = _spiffs_wr(fs, SPIFFS_OP_C_WRTHRU | SPIFFS_OP_T_OBJ_LU2, 0,
@@ -422,6 +525,9 @@ s32_t spiffs_obj_lu_scan(
   fs->free_blocks = 0;
   fs->stats_p_allocated = 0;
   fs->stats_p_deleted = 0;
+#if SPIFFS_SUMMARY
+  fs->summary_counts = 0;
+#endif
 
   res = spiffs_obj_lu_find_entry_visitor(fs,
       0,
@@ -443,6 +549,257 @@ s32_t spiffs_obj_lu_scan(
   return res;
 }
 
+#if SPIFFS_SUMMARY
+// FNV-1a hash of a mount summary, but for its check field
+static u32_t spiffs_summary_check(
+    const spiffs_summary *summary) {
+  const u8_t *p = (const u8_t *)summary;
+  u32_t hash = 2166136261u;
+  u32_t i;
+  for (i = 0; i < offsetof(spiffs_summary, check); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// The summary page is written to the first free page, so it is looked for up
+// to the first free object lookup entry only
+static s32_t spiffs_summary_find_v(
+    spiffs *fs,
+    spiffs_obj_id obj_id,
+    spiffs_block_ix bix,
+    int ix_entry,
+    const void *user_const_p,
+    void *user_var_p) {
+  (void)fs;
+  (void)bix;
+  (void)ix_entry;
+  (void)user_const_p;
+  (void)user_var_p;
+  if (obj_id == SPIFFS_SUMMARY_OBJ_ID) {
+    return SPIFFS_OK;
+  }
+  if (obj_id == SPIFFS_OBJ_ID_FREE) {
+    return SPIFFS_ERR_NOT_FOUND;
+  }
+  return SPIFFS_VIS_COUNTINUE;
+}
+
+// Finds the first free page after the object lookup entry of the summary
+// page and reads the erase count of its block
+static s32_t spiffs_summary_next_free(
+    spiffs *fs,
+    spiffs_block_ix bix,
+    int entry,
+    spiffs_page_ix *free_pix,
+    spiffs_obj_id *erase_count) {
+  s32_t res;
+  res = spiffs_obj_lu_find_id(fs, bix, entry + 1, SPIFFS_OBJ_ID_FREE, &bix, &entry);
+  SPIFFS_CHECK_RES(res);
+  *free_pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry);
+  return _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_ERASE_COUNT_PADDR(fs, bix), sizeof(spiffs_obj_id), (u8_t *)erase_count);
+}
+
+// Takes what spiffs_obj_lu_scan would find from the summary page written on
+// the last unmount, if there is a sane one, and scans otherwise. A summary
+// page that can't be used is deleted.
+s32_t spiffs_summary_load(
+    spiffs *fs) {
+  s32_t res;
+  spiffs_block_ix bix;
+  int entry;
+  spiffs_page_ix pix;
+  spiffs_page_header p_hdr;
+  spiffs_summary summary;
+  spiffs_page_ix free_pix;
+  spiffs_obj_id erase_count;
+
+  res = spiffs_obj_lu_find_entry_visitor(fs, 0, 0, SPIFFS_VIS_NO_WRAP, 0,
+      spiffs_summary_find_v, 0, 0, &bix, &entry);
+  if (res == SPIFFS_VIS_END || res == SPIFFS_ERR_NOT_FOUND) {
+    return spiffs_obj_lu_scan(fs);
+  }
+  SPIFFS_CHECK_RES(res);
+
+  pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry);
+  res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_PAGE_TO_PADDR(fs, pix), sizeof(spiffs_page_header), (u8_t *)&p_hdr);
+  SPIFFS_CHECK_RES(res);
+  res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_PAGE_TO_PADDR(fs, pix) + sizeof(spiffs_page_header), sizeof(spiffs_summary), (u8_t *)&summary);
+  SPIFFS_CHECK_RES(res);
+  if (p_hdr.obj_id == SPIFFS_SUMMARY_OBJ_ID && p_hdr.span_ix == 0 &&
+      (p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_USED)) ==
+          (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_INDEX) &&
+      summary.magic == SPIFFS_SUMMARY_MAGIC &&
+      summary.block_count == fs->block_count &&
+      summary.check == spiffs_summary_check(&summary)) {
+    // a writer built without summaries allocates the first free page after
+    // it, or erases its block, before anything else
+    res = spiffs_summary_next_free(fs, bix, entry, &free_pix, &erase_count);
+    if (res != SPIFFS_ERR_NOT_FOUND) {
+      SPIFFS_CHECK_RES(res);
+    }
+    if (res == SPIFFS_OK && free_pix == summary.next_free_pix &&
+        erase_count == summary.next_free_erase_count) {
+      SPIFFS_DBG("mount: summary "_SPIPRIi" at "_SPIPRIpg"\n", summary.seq, pix);
+      fs->free_blocks = summary.free_blocks;
+      fs->stats_p_allocated = summary.stats_p_allocated;
+      fs->stats_p_deleted = summary.stats_p_deleted;
+      fs->max_erase_count = (spiffs_obj_id)summary.max_erase_count;
+      fs->summary_seq = summary.seq;
+      fs->summary_pix = pix;
+      fs->summary_counts = 1;
+      return SPIFFS_OK;
+    }
+  }
+
+  SPIFFS_DBG("mount: bad summary at "_SPIPRIpg"\n", pix);
+  res = spiffs_obj_lu_scan(fs);
+#if !SPIFFS_READ_ONLY
+  if (res == SPIFFS_OK) {
+    res = spiffs_page_delete(fs, pix);
+  }
+#endif
+  return res;
+}
+
+#if !SPIFFS_READ_ONLY
+// Writes what spiffs_obj_lu_scan would find to a summary page for the next
+// mount. The page is the first free one, where the next mount stops looking
+// for it. Nothing is written if that could take garbage collection.
+s32_t spiffs_summary_write(
+    spiffs *fs) {
+  s32_t res;
+  spiffs_page_header p_hdr;
+  spiffs_summary summary;
+  spiffs_page_ix pix;
+  spiffs_page_ix free_pix;
+  spiffs_obj_id erase_count;
+
+  if (fs->summary_pix) {
+    // mounted from a summary and nothing changed since
+    return SPIFFS_OK;
+  }
+  // recount rather than trust the running counters, as erasing a block that
+  // was already free counts it again
+  res = spiffs_obj_lu_scan(fs);
+  SPIFFS_CHECK_RES(res);
+  if (fs->free_blocks < 2) {
+    return SPIFFS_ERR_FULL;
+  }
+
+  fs->free_cursor_block_ix = 0;
+  fs->free_cursor_obj_lu_entry = 0;
+  p_hdr.obj_id = SPIFFS_SUMMARY_OBJ_ID;
+  p_hdr.span_ix = 0;
+  p_hdr.flags = 0xff & ~(SPIFFS_PH_FLAG_FINAL);
+  res = spiffs_page_allocate_data(fs, SPIFFS_SUMMARY_OBJ_ID, &p_hdr, 0, 0, 0, 1, &pix);
+  SPIFFS_CHECK_RES(res);
+  res = spiffs_summary_next_free(fs, SPIFFS_BLOCK_FOR_PAGE(fs, pix), SPIFFS_OBJ_LOOKUP_ENTRY_FOR_PAGE(fs, pix),
+      &free_pix, &erase_count);
+  SPIFFS_CHECK_RES(res);
+
+  // the counters now include the summary page itself
+  summary.magic = SPIFFS_SUMMARY_MAGIC;
+  summary.seq = fs->summary_seq + 1;
+  summary.block_count = fs->block_count;
+  summary.free_blocks = fs->free_blocks;
+  summary.stats_p_allocated = fs->stats_p_allocated;
+  summary.stats_p_deleted = fs->stats_p_deleted;
+  summary.max_erase_count = fs->max_erase_count;
+  summary.next_free_pix = free_pix;
+  summary.next_free_erase_count = erase_count;
+  summary.check = spiffs_summary_check(&summary);
+  res = _spiffs_wr(fs, SPIFFS_OP_T_OBJ_DA | SPIFFS_OP_C_UPDT,
+      0, SPIFFS_PAGE_TO_PADDR(fs, pix) + sizeof(spiffs_page_header), sizeof(spiffs_summary), (u8_t *)&summary);
+  SPIFFS_CHECK_RES(res);
+  SPIFFS_DBG("unmount: summary "_SPIPRIi" at "_SPIPRIpg"\n", summary.seq, pix);
+  return res;
+}
+
+// Deletes the summary page the file system was mounted from, called before
+// anything is written to flash, as that makes the summary stale
+s32_t spiffs_summary_invalidate(
+    spiffs *fs) {
+  s32_t res;
+  spiffs_page_ix pix = fs->summary_pix;
+  if (pix == 0) {
+    return SPIFFS_OK;
+  }
+  // the deletion writes to flash too
+  fs->summary_pix = 0;
+  res = spiffs_page_delete(fs, pix);
+  if (res != SPIFFS_OK) {
+    fs->summary_pix = pix;
+  }
+  return res;
+}
+#endif // !SPIFFS_READ_ONLY
+#endif // SPIFFS_SUMMARY
+
+#if SPIFFS_FREE_COUNTS
+#if !SPIFFS_READ_ONLY
+// Finds a free object lookup entry without reading flash. Entries are handed
+// out in order and only freed again by erasing their whole block, so the free
+// entries counted for a block are the last ones of it and the first of them
+// is the next to take.
+static s32_t spiffs_free_counts_find(
+    spiffs *fs,
+    spiffs_block_ix starting_block,
+    int starting_lu_entry,
+    spiffs_block_ix *block_ix,
+    int *lu_entry) {
+  spiffs_page_ix *free_pages = fs->free_counts;
+  u32_t i;
+  if (starting_lu_entry >= (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)) {
+    starting_block = (starting_block + 1) % fs->block_count;
+  }
+  for (i = 0; i < fs->block_count; i++) {
+    spiffs_block_ix bix = (starting_block + i) % fs->block_count;
+    if (free_pages[bix] == 0) continue;
+    *block_ix = bix;
+    *lu_entry = SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs) - free_pages[bix];
+    return SPIFFS_OK;
+  }
+  return SPIFFS_ERR_NOT_FOUND;
+}
+#endif // !SPIFFS_READ_ONLY
+
+// Counts the free object lookup entries at the end of each block. Free entries
+// before a used one, as left by a failed write or by another writer, are not
+// counted and wait for the block to be erased.
+s32_t spiffs_free_counts_build(
+    spiffs *fs) {
+  s32_t res = SPIFFS_OK;
+  spiffs_page_ix *free_pages = fs->free_counts;
+  spiffs_obj_id *obj_lu_buf = (spiffs_obj_id *)fs->lu_work;
+  int entries_per_page = (SPIFFS_CFG_LOG_PAGE_SZ(fs) / sizeof(spiffs_obj_id));
+  spiffs_block_ix bix;
+  for (bix = 0; bix < fs->block_count; bix++) {
+    int obj_lookup_page;
+    int cur_entry = 0;
+    free_pages[bix] = 0;
+    for (obj_lookup_page = 0; obj_lookup_page < (int)SPIFFS_OBJ_LOOKUP_PAGES(fs); obj_lookup_page++) {
+      int entry_offset = obj_lookup_page * entries_per_page;
+      res = spiffs_obj_lu_page_read(fs, bix, obj_lookup_page);
+      SPIFFS_CHECK_RES(res);
+      while (cur_entry - entry_offset < entries_per_page &&
+          cur_entry < (int)SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)) {
+        if (obj_lu_buf[cur_entry - entry_offset] == SPIFFS_OBJ_ID_FREE) {
+          free_pages[bix]++;
+        } else {
+          free_pages[bix] = 0;
+        }
+        cur_entry++;
+      }
+    }
+  }
+  return res;
+}
+#endif // SPIFFS_FREE_COUNTS
+
 #if !SPIFFS_READ_ONLY
 // Find free object lookup entry
 // Iterate over object lookup pages in each block until a free object id entry is found
@@ -463,9 +820,22 @@ s32_t spiffs_obj_lu_find_free(
       return SPIFFS_ERR_FULL;
     }
   }
+#if SPIFFS_FREE_COUNTS
+  if (fs->free_counts) {
+    res = spiffs_free_counts_find(fs, starting_block, starting_lu_entry, block_ix, lu_entry);
+  } else {
+    res = spiffs_obj_lu_find_id(fs, starting_block, starting_lu_entry,
+        SPIFFS_OBJ_ID_FREE, block_ix, lu_entry);
+  }
+#else
   res = spiffs_obj_lu_find_id(fs, starting_block, starting_lu_entry,
       SPIFFS_OBJ_ID_FREE, block_ix, lu_entry);
+#endif
   if (res == SPIFFS_OK) {
+#if SPIFFS_FREE_COUNTS
+    // the caller takes the entry
+    if (fs->free_counts) fs->free_counts[*block_ix]--;
+#endif
     fs->free_cursor_block_ix = *block_ix;
     fs->free_cursor_obj_lu_entry = (*lu_entry) + 1;
     if (*lu_entry == 0) {
@@ -917,12 +1287,19 @@ s32_t spiffs_object_create(
   int entry;
 
   res = spiffs_gc_check(fs, SPIFFS_DATA_PAGE_SIZE(fs));
-  SPIFFS_CHECK_RES(res);
 
   obj_id |= SPIFFS_OBJ_ID_IX_FLAG;
 
   // find free entry
-  res = spiffs_obj_lu_find_free(fs, fs->free_cursor_block_ix, fs->free_cursor_obj_lu_entry, &bix, &entry);
+  if (res == SPIFFS_OK) {
+    res = spiffs_obj_lu_find_free(fs, fs->free_cursor_block_ix, fs->free_cursor_obj_lu_entry, &bix, &entry);
+  }
+#if SPIFFS_OBJ_ID_MAP
+  if (res != SPIFFS_OK) {
+    // nothing of the object reached flash, so its id is free again
+    spiffs_obj_id_map_free(fs, obj_id);
+  }
+#endif
   SPIFFS_CHECK_RES(res);
   SPIFFS_DBG("create: found free page @ "_SPIPRIpg" bix:"_SPIPRIbl" entry:"_SPIPRIsp"\n", (spiffs_page_ix)SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, entry), bix, entry);
 
@@ -1050,6 +1427,11 @@ void spiffs_cb_object_event(
   spiffs_fd *fds = (spiffs_fd *)fs->fd_space;
   SPIFFS_DBG("       CALLBACK  %s obj_id:"_SPIPRIid" spix:"_SPIPRIsp" npix:"_SPIPRIpg" nsz:"_SPIPRIi"\n", (const char *[]){"UPD", "NEW", "DEL", "MOV", "HUP","???"}[MIN(ev,5)],
       obj_id_raw, spix, new_pix, new_size);
+#if SPIFFS_NAME_HASH
+  if (fs->name_hash && spix == 0) {
+    spiffs_name_hash_event(fs, objix, ev, obj_id, new_pix);
+  }
+#endif
   for (i = 0; i < fs->fd_count; i++) {
     spiffs_fd *cur_fd = &fds[i];
     if ((cur_fd->obj_id & ~SPIFFS_OBJ_ID_IX_FLAG) != obj_id) continue; // fd not related to updated file
@@ -1682,6 +2064,333 @@ static s32_t spiffs_object_find_object_index_header_by_name_v(
   return SPIFFS_VIS_COUNTINUE;
 }
 
+#if SPIFFS_NAME_INDEX || SPIFFS_NAME_HASH
+// FNV-1a hash of an object name, as stored in name index tables
+u32_t spiffs_name_index_hash(
+    const u8_t name[SPIFFS_OBJ_NAME_LEN]) {
+  u32_t hash = 2166136261u;
+  int i;
+  for (i = 0; i < SPIFFS_OBJ_NAME_LEN && name[i] != 0; i++) {
+    hash = (hash ^ name[i]) * 16777619u;
+  }
+  return hash;
+}
+#endif
+
+#if SPIFFS_NAME_INDEX
+
+// Looks for the name index table and, if it is sane, uses it for name lookups
+// from now on. A missing or broken table is not an error, names are then
+// looked up by scanning only. Only tables whose data pages are all listed in
+// their object index header page are used.
+s32_t spiffs_name_index_load(
+    spiffs *fs) {
+  s32_t res;
+  spiffs_page_ix pix;
+  spiffs_fd fd;
+  spiffs_name_index_header hdr;
+  u8_t name[SPIFFS_OBJ_NAME_LEN];
+  spiffs_block_ix cursor_bix = fs->cursor_block_ix;
+  int cursor_entry = fs->cursor_obj_lu_entry;
+
+  fs->name_index_count = 0;
+  strncpy((char *)name, SPIFFS_NAME_INDEX_FILE, SPIFFS_OBJ_NAME_LEN);
+  res = spiffs_object_find_object_index_header_by_name(fs, name, &pix);
+  // leave the search cursor where it was
+  fs->cursor_block_ix = cursor_bix;
+  fs->cursor_obj_lu_entry = cursor_entry;
+  if (res == SPIFFS_ERR_NOT_FOUND) {
+    return SPIFFS_OK;
+  }
+  SPIFFS_CHECK_RES(res);
+
+  memset(&fd, 0, sizeof(spiffs_fd));
+  res = spiffs_object_open_by_page(fs, pix, &fd, SPIFFS_O_RDONLY, 0);
+  SPIFFS_CHECK_RES(res);
+  if (fd.size == SPIFFS_UNDEFINED_LEN || fd.size < sizeof(spiffs_name_index_header) ||
+      fd.size > SPIFFS_OBJ_HDR_IX_LEN(fs) * SPIFFS_DATA_PAGE_SIZE(fs)) {
+    return SPIFFS_OK;
+  }
+  res = spiffs_object_read(&fd, 0, sizeof(spiffs_name_index_header), (u8_t *)&hdr);
+  SPIFFS_CHECK_RES(res);
+  if (hdr.magic != SPIFFS_NAME_INDEX_MAGIC ||
+      fd.size != sizeof(spiffs_name_index_header) + hdr.count * sizeof(spiffs_name_index_entry)) {
+    return SPIFFS_OK;
+  }
+  SPIFFS_DBG("name index: "_SPIPRIi" entries in table at "_SPIPRIpg"\n", hdr.count, pix);
+  fs->name_index_pix = pix;
+  fs->name_index_obj_id = fd.obj_id;
+  fs->name_index_count = hdr.count;
+  return SPIFFS_OK;
+}
+
+// Reads from the name index table, whose object index header page has been
+// read to fs->lu_work. Reads are small and bypass the cache, like the second
+// layer lookups of the scan they replace.
+static s32_t spiffs_name_index_read(
+    spiffs *fs,
+    u32_t offset,
+    u32_t len,
+    u8_t *dst) {
+  s32_t res = SPIFFS_OK;
+  spiffs_page_ix *data_pix = (spiffs_page_ix *)(fs->lu_work + sizeof(spiffs_page_object_ix_header));
+  while (len > 0) {
+    spiffs_span_ix spix = offset / SPIFFS_DATA_PAGE_SIZE(fs);
+    u32_t page_offset = offset % SPIFFS_DATA_PAGE_SIZE(fs);
+    u32_t chunk = MIN(len, SPIFFS_DATA_PAGE_SIZE(fs) - page_offset);
+    if (data_pix[spix] >= SPIFFS_MAX_PAGES(fs) || SPIFFS_IS_LOOKUP_PAGE(fs, data_pix[spix])) {
+      return SPIFFS_ERR_INDEX_INVALID;
+    }
+    res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+        0, SPIFFS_PAGE_TO_PADDR(fs, data_pix[spix]) + sizeof(spiffs_page_header) + page_offset, chunk, dst);
+    SPIFFS_CHECK_RES(res);
+    offset += chunk;
+    len -= chunk;
+    dst += chunk;
+  }
+  return res;
+}
+
+// Looks a name up in the name index table with a binary search on its hash,
+// checking every candidate against its object index header
+static s32_t spiffs_name_index_find(
+    spiffs *fs,
+    const u8_t name[SPIFFS_OBJ_NAME_LEN],
+    spiffs_page_ix *pix) {
+  s32_t res;
+  spiffs_page_object_ix_header *table_hdr = (spiffs_page_object_ix_header *)fs->lu_work;
+  spiffs_name_index_entry e;
+  spiffs_page_object_ix_header objix_hdr;
+  u32_t hash = spiffs_name_index_hash(name);
+  u32_t lo = 0;
+  u32_t hi = fs->name_index_count;
+  u32_t table_size = sizeof(spiffs_name_index_header) + hi * sizeof(spiffs_name_index_entry);
+  u32_t table_pages = (table_size + SPIFFS_DATA_PAGE_SIZE(fs) - 1) / SPIFFS_DATA_PAGE_SIZE(fs);
+
+  // table header and data page list in one go
+  res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_PAGE_TO_PADDR(fs, fs->name_index_pix),
+      sizeof(spiffs_page_object_ix_header) + table_pages * sizeof(spiffs_page_ix), fs->lu_work);
+  SPIFFS_CHECK_RES(res);
+  // the table must not have been moved or removed since mount
+  if (table_hdr->p_hdr.obj_id != (fs->name_index_obj_id | SPIFFS_OBJ_ID_IX_FLAG) || table_hdr->p_hdr.span_ix != 0 ||
+      (table_hdr->p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_IXDELE)) !=
+          (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE) ||
+      table_hdr->size != table_size) {
+    fs->name_index_count = 0;
+    return SPIFFS_ERR_NOT_FOUND;
+  }
+
+  while (lo < hi) {
+    u32_t mid = lo + (hi - lo) / 2;
+    res = spiffs_name_index_read(fs, sizeof(spiffs_name_index_header) + mid * sizeof(spiffs_name_index_entry),
+        sizeof(spiffs_name_index_entry), (u8_t *)&e);
+    SPIFFS_CHECK_RES(res);
+    if (e.hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  for (; lo < fs->name_index_count; lo++) {
+    res = spiffs_name_index_read(fs, sizeof(spiffs_name_index_header) + lo * sizeof(spiffs_name_index_entry),
+        sizeof(spiffs_name_index_entry), (u8_t *)&e);
+    SPIFFS_CHECK_RES(res);
+    if (e.hash != hash) {
+      break;
+    }
+    if (e.pix >= SPIFFS_MAX_PAGES(fs) || SPIFFS_IS_LOOKUP_PAGE(fs, e.pix)) {
+      continue;
+    }
+    res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+        0, SPIFFS_PAGE_TO_PADDR(fs, e.pix), sizeof(spiffs_page_object_ix_header), (u8_t *)&objix_hdr);
+    SPIFFS_CHECK_RES(res);
+    if (objix_hdr.p_hdr.span_ix == 0 &&
+        (objix_hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_INDEX | SPIFFS_PH_FLAG_IXDELE)) ==
+            (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE) &&
+        strncmp((const char *)name, (char *)objix_hdr.name, SPIFFS_OBJ_NAME_LEN) == 0) {
+      *pix = (spiffs_page_ix)e.pix;
+      return SPIFFS_OK;
+    }
+  }
+  return SPIFFS_ERR_NOT_FOUND;
+}
+#endif // SPIFFS_NAME_INDEX
+
+#if SPIFFS_NAME_HASH
+// The name hash table is open addressed with linear probing, an entry's home
+// slot being its hash modulo the number of slots. It is never filled beyond
+// SPIFFS_NAME_HASH_MAX_COUNT so that every probe ends at an empty slot.
+#define SPIFFS_NAME_HASH_MAX_COUNT(fs) \
+  ((fs)->name_hash_slots - 1 - (fs)->name_hash_slots / 4)
+
+static s32_t spiffs_name_hash_insert(
+    spiffs *fs,
+    u32_t hash,
+    spiffs_obj_id obj_id,
+    spiffs_page_ix pix) {
+  spiffs_name_hash_entry *tbl = (spiffs_name_hash_entry *)fs->name_hash;
+  u32_t i = hash % fs->name_hash_slots;
+  if (fs->name_hash_count >= SPIFFS_NAME_HASH_MAX_COUNT(fs)) {
+    return SPIFFS_ERR_NAME_HASH_FULL;
+  }
+  while (tbl[i].pix != 0) {
+    i = (i + 1) % fs->name_hash_slots;
+  }
+  tbl[i].hash = hash;
+  tbl[i].obj_id = obj_id;
+  tbl[i].pix = pix;
+  fs->name_hash_count++;
+  return SPIFFS_OK;
+}
+
+// Removes the entry in slot i, shifting back later entries of its probe run
+// that would otherwise no longer be found
+static void spiffs_name_hash_remove(
+    spiffs *fs,
+    u32_t i) {
+  spiffs_name_hash_entry *tbl = (spiffs_name_hash_entry *)fs->name_hash;
+  u32_t j = i;
+  while (1) {
+    j = (j + 1) % fs->name_hash_slots;
+    if (tbl[j].pix == 0) break;
+    u32_t home = tbl[j].hash % fs->name_hash_slots;
+    // move entry j into the hole unless its home lies cyclically in (i, j]
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      tbl[i] = tbl[j];
+      i = j;
+    }
+  }
+  tbl[i].pix = 0;
+  fs->name_hash_count--;
+}
+
+// Returns the slot of object obj_id, or -1. The probe run of hash is searched
+// first; if the name may have changed, all slots are searched after that.
+static s32_t spiffs_name_hash_slot(
+    spiffs *fs,
+    spiffs_obj_id obj_id,
+    u32_t hash,
+    u8_t probe_only) {
+  spiffs_name_hash_entry *tbl = (spiffs_name_hash_entry *)fs->name_hash;
+  u32_t i;
+  for (i = hash % fs->name_hash_slots; tbl[i].pix != 0; i = (i + 1) % fs->name_hash_slots) {
+    if (tbl[i].obj_id == obj_id) return (s32_t)i;
+  }
+  if (probe_only) return -1;
+  for (i = 0; i < fs->name_hash_slots; i++) {
+    if (tbl[i].pix != 0 && tbl[i].obj_id == obj_id) return (s32_t)i;
+  }
+  return -1;
+}
+
+static s32_t spiffs_name_hash_build_v(
+    spiffs *fs,
+    spiffs_obj_id obj_id,
+    spiffs_block_ix bix,
+    int ix_entry,
+    const void *user_const_p,
+    void *user_var_p) {
+  (void)user_const_p;
+  (void)user_var_p;
+  s32_t res;
+  spiffs_page_object_ix_header objix_hdr;
+  spiffs_page_ix pix = SPIFFS_OBJ_LOOKUP_ENTRY_TO_PIX(fs, bix, ix_entry);
+  if (obj_id == SPIFFS_OBJ_ID_FREE || obj_id == SPIFFS_OBJ_ID_DELETED ||
+      (obj_id & SPIFFS_OBJ_ID_IX_FLAG) == 0) {
+    return SPIFFS_VIS_COUNTINUE;
+  }
+  res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+      0, SPIFFS_PAGE_TO_PADDR(fs, pix), sizeof(spiffs_page_object_ix_header), (u8_t *)&objix_hdr);
+  SPIFFS_CHECK_RES(res);
+  if (objix_hdr.p_hdr.span_ix == 0 &&
+      (objix_hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE)) ==
+          (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE)) {
+    res = spiffs_name_hash_insert(fs, spiffs_name_index_hash(objix_hdr.name),
+        obj_id & ~SPIFFS_OBJ_ID_IX_FLAG, pix);
+    SPIFFS_CHECK_RES(res);
+  }
+  return SPIFFS_VIS_COUNTINUE;
+}
+
+// Fills the name hash table with all object index headers on the medium
+s32_t spiffs_name_hash_build(
+    spiffs *fs) {
+  memset(fs->name_hash, 0, fs->name_hash_slots * sizeof(spiffs_name_hash_entry));
+  fs->name_hash_count = 0;
+  s32_t res = spiffs_obj_lu_find_entry_visitor(fs, 0, 0, SPIFFS_VIS_NO_WRAP, 0,
+      spiffs_name_hash_build_v, 0, 0, 0, 0);
+  if (res == SPIFFS_VIS_END) res = SPIFFS_OK;
+  return res;
+}
+
+// Keeps the name hash table current on object index header events. objix is
+// the new object index header for all events but SPIFFS_EV_IX_DEL and
+// SPIFFS_EV_IX_MOV. A table that overflows is dropped.
+void spiffs_name_hash_event(
+    spiffs *fs,
+    spiffs_page_object_ix *objix,
+    int ev,
+    spiffs_obj_id obj_id,
+    spiffs_page_ix new_pix) {
+  spiffs_name_hash_entry *tbl = (spiffs_name_hash_entry *)fs->name_hash;
+  s32_t slot;
+  if (ev == SPIFFS_EV_IX_DEL || ev == SPIFFS_EV_IX_MOV) {
+    slot = spiffs_name_hash_slot(fs, obj_id, 0, 0);
+    if (slot < 0) return;
+    if (ev == SPIFFS_EV_IX_DEL) {
+      spiffs_name_hash_remove(fs, (u32_t)slot);
+    } else {
+      tbl[slot].pix = new_pix;
+    }
+    return;
+  }
+  u32_t hash = spiffs_name_index_hash(((spiffs_page_object_ix_header *)objix)->name);
+  // unless renamed, the object is found in the probe run of its name
+  slot = spiffs_name_hash_slot(fs, obj_id, hash, ev == SPIFFS_EV_IX_NEW);
+  if (slot >= 0 && tbl[slot].hash == hash) {
+    tbl[slot].pix = new_pix;
+    return;
+  }
+  if (slot >= 0) {
+    spiffs_name_hash_remove(fs, (u32_t)slot);
+  }
+  if (spiffs_name_hash_insert(fs, hash, obj_id, new_pix) != SPIFFS_OK) {
+    SPIFFS_DBG("name hash: table full, dropping it\n");
+    fs->name_hash = 0;
+  }
+}
+
+// Looks a name up in the name hash table, reading the object index header of
+// each candidate with the same hash. The table is complete, so a name it
+// doesn't have does not exist.
+static s32_t spiffs_name_hash_find(
+    spiffs *fs,
+    const u8_t name[SPIFFS_OBJ_NAME_LEN],
+    spiffs_page_ix *pix) {
+  s32_t res;
+  spiffs_name_hash_entry *tbl = (spiffs_name_hash_entry *)fs->name_hash;
+  spiffs_page_object_ix_header objix_hdr;
+  u32_t hash = spiffs_name_index_hash(name);
+  u32_t i;
+  for (i = hash % fs->name_hash_slots; tbl[i].pix != 0; i = (i + 1) % fs->name_hash_slots) {
+    if (tbl[i].hash != hash) continue;
+    res = _spiffs_rd(fs, SPIFFS_OP_T_OBJ_LU2 | SPIFFS_OP_C_READ,
+        0, SPIFFS_PAGE_TO_PADDR(fs, tbl[i].pix), sizeof(spiffs_page_object_ix_header), (u8_t *)&objix_hdr);
+    SPIFFS_CHECK_RES(res);
+    if (objix_hdr.p_hdr.span_ix == 0 &&
+        (objix_hdr.p_hdr.flags & (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_FINAL | SPIFFS_PH_FLAG_IXDELE)) ==
+            (SPIFFS_PH_FLAG_DELET | SPIFFS_PH_FLAG_IXDELE) &&
+        strcmp((const char *)name, (char *)objix_hdr.name) == 0) {
+      *pix = tbl[i].pix;
+      return SPIFFS_OK;
+    }
+  }
+  return SPIFFS_ERR_NOT_FOUND;
+}
+#endif // SPIFFS_NAME_HASH
+
 // Finds object index header page by name
 s32_t spiffs_object_find_object_index_header_by_name(
     spiffs *fs,
@@ -1691,6 +2400,30 @@ s32_t spiffs_object_find_object_index_header_by_name(
   spiffs_block_ix bix;
   int entry;
 
+#if SPIFFS_NAME_HASH
+  if (fs->name_hash) {
+    spiffs_page_ix found;
+    res = spiffs_name_hash_find(fs, name, &found);
+    if (res == SPIFFS_OK && pix) {
+      *pix = found;
+    }
+    return res;
+  }
+#endif
+
+#if SPIFFS_NAME_INDEX
+  if (fs->name_index_count) {
+    spiffs_page_ix found;
+    // anything but a verified hit falls back to scanning
+    if (spiffs_name_index_find(fs, name, &found) == SPIFFS_OK) {
+      if (pix) {
+        *pix = found;
+      }
+      return SPIFFS_OK;
+    }
+  }
+#endif
+
   res = spiffs_obj_lu_find_entry_visitor(fs,
       fs->cursor_block_ix,
       fs->cursor_obj_lu_entry,
@@ -1913,6 +2646,10 @@ s32_t spiffs_object_truncate(
 
         res = spiffs_page_delete(fs, objix_pix);
         SPIFFS_CHECK_RES(res);
+#if SPIFFS_OBJ_ID_MAP
+        // before the event, which releases fd
+        spiffs_obj_id_map_free(fs, fd->obj_id);
+#endif
         spiffs_cb_object_event(fs, (spiffs_page_object_ix *)0,
             SPIFFS_EV_IX_DEL, fd->obj_id, 0, objix_pix, 0);
       } else {
@@ -2050,6 +2787,81 @@ s32_t spiffs_object_read(
   return res;
 }
 
+#if SPIFFS_OBJ_ID_MAP
+static s32_t spiffs_obj_id_map_build_v(spiffs *fs, spiffs_obj_id id, spiffs_block_ix bix, int ix_entry,
+    const void *user_const_p, void *user_var_p) {
+  (void)bix;
+  (void)ix_entry;
+  (void)user_const_p;
+  (void)user_var_p;
+  if (id != SPIFFS_OBJ_ID_FREE && id != SPIFFS_OBJ_ID_DELETED) {
+    u32_t bit_ix = (id & ~SPIFFS_OBJ_ID_IX_FLAG) - 1;
+    if (bit_ix < SPIFFS_OBJ_ID_MAP_IDS(fs)) {
+      fs->obj_id_map[bit_ix >> 3] |= (1 << (bit_ix & 7));
+    }
+  }
+  return SPIFFS_VIS_COUNTINUE;
+}
+
+// Marks all object ids found in object lookup pages in the object id map.
+// Like the scan in spiffs_obj_lu_find_free_obj_id, an id is in use as long
+// as any page of it is left, not only while there is an object index header.
+s32_t spiffs_obj_id_map_build(
+    spiffs *fs) {
+  memset(fs->obj_id_map, 0, (SPIFFS_OBJ_ID_MAP_IDS(fs) + 7) / 8);
+  s32_t res = spiffs_obj_lu_find_entry_visitor(fs, 0, 0, 0, 0, spiffs_obj_id_map_build_v, 0, 0, 0, 0);
+  if (res == SPIFFS_VIS_END) res = SPIFFS_OK;
+  return res;
+}
+
+// Called when all pages of an object have been deleted
+void spiffs_obj_id_map_free(
+    spiffs *fs,
+    spiffs_obj_id obj_id) {
+  u32_t bit_ix = (obj_id & ~SPIFFS_OBJ_ID_IX_FLAG) - 1;
+  if (fs->obj_id_map && bit_ix < SPIFFS_OBJ_ID_MAP_IDS(fs)) {
+    fs->obj_id_map[bit_ix >> 3] &= ~(1 << (bit_ix & 7));
+  }
+}
+
+#if !SPIFFS_READ_ONLY
+// Takes the lowest object id not in use from the object id map. The id is
+// marked right away; spiffs_object_create clears it again if the object
+// can't be created.
+static s32_t spiffs_obj_id_map_find_free(
+    spiffs *fs,
+    spiffs_obj_id *obj_id,
+    const u8_t *conflicting_name) {
+  u32_t ids = SPIFFS_OBJ_ID_MAP_IDS(fs);
+  u32_t i, j;
+  if (conflicting_name) {
+    spiffs_page_ix pix;
+    s32_t res = spiffs_object_find_object_index_header_by_name(fs, conflicting_name, &pix);
+    if (res == SPIFFS_OK) {
+      return SPIFFS_ERR_CONFLICTING_NAME;
+    }
+    if (res != SPIFFS_ERR_NOT_FOUND) {
+      return res;
+    }
+  }
+  for (i = 0; i < (ids + 7) / 8; i++) {
+    u8_t mask = fs->obj_id_map[i];
+    if (mask == 0xff) {
+      continue;
+    }
+    for (j = 0; j < 8 && (i<<3)+j < ids; j++) {
+      if ((mask & (1<<j)) == 0) {
+        fs->obj_id_map[i] |= (1<<j);
+        *obj_id = (i<<3)+j+1;
+        return SPIFFS_OK;
+      }
+    }
+  }
+  return SPIFFS_ERR_FULL;
+}
+#endif // !SPIFFS_READ_ONLY
+#endif // SPIFFS_OBJ_ID_MAP
+
 #if !SPIFFS_READ_ONLY
 typedef struct {
   spiffs_obj_id min_obj_id;
@@ -2132,9 +2944,14 @@ s32_t spiffs_obj_lu_find_free_obj_id(spiffs *fs, spiffs_obj_id *obj_id, const u8
   spiffs_obj_id free_obj_id = SPIFFS_OBJ_ID_FREE;
   state.min_obj_id = 1;
   state.max_obj_id = max_objects + 1;
-  if (state.max_obj_id & SPIFFS_OBJ_ID_IX_FLAG) {
-    state.max_obj_id = ((spiffs_obj_id)-1) & ~SPIFFS_OBJ_ID_IX_FLAG;
+  if ((state.max_obj_id & SPIFFS_OBJ_ID_IX_FLAG) || state.max_obj_id > SPIFFS_OBJ_ID_LAST) {
+    state.max_obj_id = SPIFFS_OBJ_ID_LAST;
   }
+#if SPIFFS_OBJ_ID_MAP
+  if (fs->obj_id_map) {
+    return spiffs_obj_id_map_find_free(fs, obj_id, conflicting_name);
+  }
+#endif
   state.compaction = 0;
   state.conflicting_name = conflicting_name;
   while (res == SPIFFS_OK && free_obj_id == SPIFFS_OBJ_ID_FREE) {
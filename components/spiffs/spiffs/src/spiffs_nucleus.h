@@ -141,6 +141,15 @@
 #define SPIFFS_OBJ_ID_DELETED           ((spiffs_obj_id)0)
 #define SPIFFS_OBJ_ID_FREE              ((spiffs_obj_id)-1)
 
+#if SPIFFS_SUMMARY
+// object id of the mount summary page, never given to an object
+#define SPIFFS_SUMMARY_OBJ_ID           ((spiffs_obj_id)(((spiffs_obj_id)-1) & ~SPIFFS_OBJ_ID_IX_FLAG))
+// highest object id given to objects
+#define SPIFFS_OBJ_ID_LAST              (SPIFFS_SUMMARY_OBJ_ID - 1)
+#else
+#define SPIFFS_OBJ_ID_LAST              (((spiffs_obj_id)-1) & ~SPIFFS_OBJ_ID_IX_FLAG)
+#endif
+
 
 
 #if defined(__GNUC__) || defined(__clang__)
@@ -169,6 +178,16 @@
 
 #define SPIFFS_CONFIG_MAGIC             (0x20090315)
 
+#if SPIFFS_NAME_INDEX
+// first word of a name index table, "SPNX"
+#define SPIFFS_NAME_INDEX_MAGIC         (0x584e5053)
+#endif
+
+#if SPIFFS_SUMMARY
+// first word of a mount summary, "SPSM"
+#define SPIFFS_SUMMARY_MAGIC            (0x4d535053)
+#endif
+
 #if SPIFFS_SINGLETON == 0
 #define SPIFFS_CFG_LOG_PAGE_SZ(fs) \
   ((fs)->cfg.log_page_size)
@@ -589,6 +608,68 @@ s32_t spiffs_erase_block(
     spiffs *fs,
     spiffs_block_ix bix);
 
+s32_t spiffs_obj_lu_page_read(
+    spiffs *fs,
+    spiffs_block_ix bix,
+    int obj_lookup_page);
+
+#if SPIFFS_FREE_COUNTS
+s32_t spiffs_free_counts_build(
+    spiffs *fs);
+#endif
+
+#if SPIFFS_SUMMARY
+// Mount summary, stored after the page header of the summary page: what
+// spiffs_obj_lu_scan would find when mounting
+typedef struct {
+  // SPIFFS_SUMMARY_MAGIC
+  u32_t magic;
+  // incremented with each summary written
+  u32_t seq;
+  u32_t block_count;
+  u32_t free_blocks;
+  u32_t stats_p_allocated;
+  u32_t stats_p_deleted;
+  u32_t max_erase_count;
+  // first free page after the summary page and the erase count of its
+  // block, which a writer that leaves the summary alone changes on its
+  // first allocation or erase there
+  u32_t next_free_pix;
+  u32_t next_free_erase_count;
+  // spiffs_summary_check of all fields above
+  u32_t check;
+} spiffs_summary;
+
+s32_t spiffs_summary_load(
+    spiffs *fs);
+
+#if !SPIFFS_READ_ONLY
+s32_t spiffs_summary_write(
+    spiffs *fs);
+
+s32_t spiffs_summary_invalidate(
+    spiffs *fs);
+#endif
+#endif
+
+#if SPIFFS_LU_SHADOW
+u8_t spiffs_lu_shadow_rd(
+    spiffs *fs,
+    u32_t addr,
+    u32_t len,
+    u8_t *dst);
+
+void spiffs_lu_shadow_wr(
+    spiffs *fs,
+    u32_t addr,
+    u32_t len,
+    u8_t *src);
+
+s32_t spiffs_lu_shadow_load(
+    spiffs *fs,
+    spiffs_obj_id *shadow);
+#endif
+
 #if SPIFFS_USE_MAGIC && SPIFFS_USE_MAGIC_LENGTH
 s32_t spiffs_probe(
     spiffs_config *cfg);
@@ -604,6 +685,20 @@ s32_t spiffs_obj_lu_find_free_obj_id(
     spiffs_obj_id *obj_id,
     const u8_t *conflicting_name);
 
+#if SPIFFS_OBJ_ID_MAP
+// number of object ids tracked in the object id map, ids 1 and up
+#define SPIFFS_OBJ_ID_MAP_IDS(fs) \
+  MIN(((fs)->block_count * SPIFFS_OBJ_LOOKUP_MAX_ENTRIES(fs)) / 2 + 1, \
+      (u32_t)SPIFFS_OBJ_ID_LAST)
+
+s32_t spiffs_obj_id_map_build(
+    spiffs *fs);
+
+void spiffs_obj_id_map_free(
+    spiffs *fs,
+    spiffs_obj_id obj_id);
+#endif
+
 s32_t spiffs_obj_lu_find_free(
     spiffs *fs,
     spiffs_block_ix starting_block,
@@ -740,6 +835,54 @@ s32_t spiffs_object_find_object_index_header_by_name(
     const u8_t name[SPIFFS_OBJ_NAME_LEN],
     spiffs_page_ix *pix);
 
+#if SPIFFS_NAME_INDEX || SPIFFS_NAME_HASH
+u32_t spiffs_name_index_hash(
+    const u8_t name[SPIFFS_OBJ_NAME_LEN]);
+#endif
+
+#if SPIFFS_NAME_INDEX
+// Name index table: a header followed by one entry per object, sorted by
+// name hash and then by page index.
+typedef struct {
+  // SPIFFS_NAME_INDEX_MAGIC
+  u32_t magic;
+  // number of entries
+  u32_t count;
+} spiffs_name_index_header;
+
+typedef struct {
+  // spiffs_name_index_hash of the object name
+  u32_t hash;
+  // object index header page
+  u32_t pix;
+} spiffs_name_index_entry;
+
+s32_t spiffs_name_index_load(
+    spiffs *fs);
+#endif
+
+#if SPIFFS_NAME_HASH
+// Name hash table slot, free if pix is 0
+typedef struct {
+  // spiffs_name_index_hash of the object name
+  u32_t hash;
+  // object id, without SPIFFS_OBJ_ID_IX_FLAG
+  spiffs_obj_id obj_id;
+  // object index header page
+  spiffs_page_ix pix;
+} spiffs_name_hash_entry;
+
+s32_t spiffs_name_hash_build(
+    spiffs *fs);
+
+void spiffs_name_hash_event(
+    spiffs *fs,
+    spiffs_page_object_ix *objix,
+    int ev,
+    spiffs_obj_id obj_id,
+    spiffs_page_ix new_pix);
+#endif
+
 // ---------------
 
 s32_t spiffs_gc_check(
@@ -48,6 +48,30 @@ void real_assert(int c, const char *n, const char *file, int l);
 #ifndef SPIFFS_HAL_CALLBACK_EXTRA
 #define SPIFFS_HAL_CALLBACK_EXTRA       1
 #endif
+// test using name index tables
+#ifndef SPIFFS_NAME_INDEX
+#define SPIFFS_NAME_INDEX               1
+#endif
+// test using lookup shadows
+#ifndef SPIFFS_LU_SHADOW
+#define SPIFFS_LU_SHADOW                1
+#endif
+// test using name hash tables
+#ifndef SPIFFS_NAME_HASH
+#define SPIFFS_NAME_HASH                1
+#endif
+// test using free page counts
+#ifndef SPIFFS_FREE_COUNTS
+#define SPIFFS_FREE_COUNTS              1
+#endif
+// test using object id maps
+#ifndef SPIFFS_OBJ_ID_MAP
+#define SPIFFS_OBJ_ID_MAP               1
+#endif
+// test using mount summaries
+#ifndef SPIFFS_SUMMARY
+#define SPIFFS_SUMMARY                  1
+#endif
 // test using filehandle offset
 #ifndef SPIFFS_FILEHDL_OFFSET
 #define SPIFFS_FILEHDL_OFFSET           1